@@ -0,0 +1,114 @@
+#include "aot.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sysexits.h>
+
+int runAot(const char *const *globalNames, unsigned globalCount,
+           const AotString *strings, unsigned stringCount,
+           AotFunction *function) {
+  VM vm;
+  initVM(&vm);
+
+  // A fresh VM hands out slots in order, so these get the same slots they had
+  // when the script was compiled.
+  for (unsigned i = 0; i < globalCount; ++i) {
+    const char *name = globalNames[i];
+    resolveGlobal(&vm, copyString(&vm, name, (unsigned)strlen(name)));
+  }
+
+  // The script's constants are roots, so the strings go there.
+  Script *script = newScript(&vm);
+  for (unsigned i = 0; i < stringCount; ++i) {
+    ObjString *string = copyString(&vm, strings[i].chars, strings[i].length);
+    addConstant(&vm, &script->chunk, OBJ_VAL(string));
+  }
+
+  InterpretResult result = function(&vm, script->chunk.constants.values);
+  freeVM(&vm);
+  return result == INTERPRET_OK ? 0 : EX_SOFTWARE;
+}
+
+void aotRuntimeError(VM *vm, unsigned line, const char *format, ...) {
+  va_list(args);
+  va_start(args, format);
+  vfprintf(vm->err, format, args);
+  va_end(args);
+
+  fprintf(vm->err, "\n[line %d] in script\n", line);
+  vm->stackTop = vm->stack;
+}
+
+bool aotCheckNumbers(VM *vm, unsigned line, const char *message) {
+  if (isNumber(aotPeek(vm, 0)) && isNumber(aotPeek(vm, 1)))
+    return true;
+  aotRuntimeError(vm, line, "%s", message);
+  return false;
+}
+
+static void undefinedVariable(VM *vm, unsigned slot, unsigned line) {
+  aotRuntimeError(vm, line, "Undefined variable '%s'.",
+                  asString(vm->globalNames.values[slot])->chars);
+}
+
+bool aotGetGlobal(VM *vm, unsigned slot, unsigned line) {
+  Value value = vm->globalValues.values[slot];
+  if (isUndefined(value)) {
+    undefinedVariable(vm, slot, line);
+    return false;
+  }
+  aotPush(vm, value);
+  return true;
+}
+
+void aotDefineGlobal(VM *vm, unsigned slot) {
+  Value value = aotPop(vm);
+  globalWriteBarrier(vm, slot, value);
+  vm->globalValues.values[slot] = value;
+}
+
+bool aotSetGlobal(VM *vm, unsigned slot, unsigned line) {
+  if (isUndefined(vm->globalValues.values[slot])) {
+    undefinedVariable(vm, slot, line);
+    return false;
+  }
+  globalWriteBarrier(vm, slot, aotPeek(vm, 0));
+  vm->globalValues.values[slot] = aotPeek(vm, 0);
+  return true;
+}
+
+void aotEqual(VM *vm, bool negate) {
+  Value a = aotPop(vm);
+  Value b = aotPop(vm);
+  aotPush(vm, boolVal(valuesEqual(vm, a, b) != negate));
+}
+
+bool aotAdd(VM *vm, unsigned line) {
+  Value b = aotPeek(vm, 0);
+  Value a = aotPeek(vm, 1);
+  if (isString(a) && isString(b)) {
+    vm->stackTop -= 2;
+    aotPush(vm, addStrings(vm, a, b));
+  } else if (isNumber(a) && isNumber(b)) {
+    AOT_BINARY(numberVal, +);
+  } else {
+    aotRuntimeError(vm, line, "Operands must be two numbers or two strings.");
+    return false;
+  }
+  return true;
+}
+
+bool aotNegate(VM *vm, unsigned line) {
+  if (!isNumber(aotPeek(vm, 0))) {
+    aotRuntimeError(vm, line, "Operand must be a number.");
+    return false;
+  }
+  aotPush(vm, numberVal(-asNumber(aotPop(vm))));
+  return true;
+}
+
+void aotPrint(VM *vm) {
+  printValue(vm, vm->out, aotPop(vm));
+  fputc('\n', vm->out);
+}
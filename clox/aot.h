@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// The runtime that C generated by `clox --emit-c` (see emitc.h) runs on. A
+// generated program is the script's bytecode spelled out as straight-line C,
+// one statement or two per instruction, with gotos for jumps. Values still live
+// on vm->stack, where the collector can find and move them, and the
+// instructions that aren't a line of C call the helpers below, which do
+// exactly what run() does, so the output is the same as the interpreter's.
+//
+// Build a generated program with libclox's public compile definitions and link
+// it against libclox.
+
+typedef struct {
+  const char *chars;
+  unsigned length;
+} AotString;
+
+// The script itself. `constants` holds its string constants, in the order they
+// were passed to runAot. The collector updates them in place, so they must be
+// read from there each time.
+typedef InterpretResult AotFunction(VM *vm, Value *constants);
+
+// Runs a generated script in a fresh VM and returns the exit code clox would
+// have. The global at slot i is named globalNames[i].
+int runAot(const char *const *globalNames, unsigned globalCount,
+           const AotString *strings, unsigned stringCount,
+           AotFunction *function);
+
+// Reports a runtime error at `line` the way the interpreter does.
+__attribute__((format(printf, 3, 4))) void
+aotRuntimeError(VM *vm, unsigned line, const char *format, ...);
+
+// The instructions that need more than a line or two. The ones that return bool
+// return false after reporting a runtime error.
+bool aotCheckNumbers(VM *vm, unsigned line, const char *message);
+bool aotGetGlobal(VM *vm, unsigned slot, unsigned line);
+void aotDefineGlobal(VM *vm, unsigned slot);
+bool aotSetGlobal(VM *vm, unsigned slot, unsigned line);
+void aotEqual(VM *vm, bool negate);
+bool aotAdd(VM *vm, unsigned line);
+bool aotNegate(VM *vm, unsigned line);
+void aotPrint(VM *vm);
+
+// See value.h for an explanation.
+#define ALWAYS_INLINE __attribute__((__always_inline__)) inline
+
+ALWAYS_INLINE void aotPush(VM *vm, Value value) { *vm->stackTop++ = value; }
+
+ALWAYS_INLINE Value aotPop(VM *vm) { return *--vm->stackTop; }
+
+ALWAYS_INLINE Value aotPeek(VM *vm, int distance) {
+  return vm->stackTop[-1 - distance];
+}
+
+// For the negated comparisons. See notBoolVal in vm.c.
+ALWAYS_INLINE Value aotNotBoolVal(bool value) { return boolVal(!value); }
+
+// For the numbers that C has no literals for.
+ALWAYS_INLINE double aotNumberFromBits(uint64_t bits) {
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+
+#undef ALWAYS_INLINE
+
+// A number operation on the top two values, which aotCheckNumbers has checked.
+#define AOT_BINARY(valueType, op)                                              \
+  do {                                                                         \
+    double b = asNumber(aotPop(vm));                                           \
+    double a = asNumber(aotPop(vm));                                           \
+    aotPush(vm, valueType(a op b));                                            \
+  } while (false)
@@ -0,0 +1,231 @@
+// open_memstream, sysconf and pthreads are POSIX, not C.
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "script.h"
+#include "vm.h"
+
+typedef struct {
+  const char *path;
+  // The script's captured output and errors.
+  char *out;
+  size_t outLength;
+  char *err;
+  size_t errLength;
+  int exitCode;
+  bool done;
+} Job;
+
+// Each worker starts out owning an even share of the jobs, as the range
+// [next, end). It runs its own jobs from the front, and once it runs out, it
+// steals the back half of another worker's remaining range. Taking from the
+// front keeps jobs finishing roughly in manifest order, which lets the output
+// be written out as the batch goes.
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned next;
+  unsigned end;
+} WorkQueue;
+
+typedef struct {
+  Job *jobs;
+  unsigned jobCount;
+  WorkQueue *queues;
+  unsigned workerCount;
+  bool jit;
+  const char *cacheDir;
+
+  // Guards every job's done flag.
+  pthread_mutex_t doneLock;
+  pthread_cond_t jobDone;
+} Batch;
+
+typedef struct {
+  Batch *batch;
+  unsigned index;
+} Worker;
+
+static void runJob(Job *job, bool jit, const char *cacheDir) {
+  FILE *out = open_memstream(&job->out, &job->outLength);
+  FILE *err = open_memstream(&job->err, &job->errLength);
+  if (out == NULL || err == NULL)
+    exit(1);
+
+  VM vm;
+  initVM(&vm);
+  vm.jit = jit;
+  vm.out = out;
+  vm.err = err;
+  job->exitCode = runFile(&vm, job->path, cacheDir);
+  freeVM(&vm);
+
+  if (fclose(out) != 0 || fclose(err) != 0)
+    exit(1);
+}
+
+// Returns the index of the next job for `worker` to run, or -1 once there's
+// nothing left to run or steal.
+static int takeJob(Worker *worker) {
+  Batch *batch = worker->batch;
+  WorkQueue *own = &batch->queues[worker->index];
+
+  pthread_mutex_lock(&own->lock);
+  if (own->next < own->end) {
+    int job = (int)own->next++;
+    pthread_mutex_unlock(&own->lock);
+    return job;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (unsigned i = 1; i < batch->workerCount; ++i) {
+    WorkQueue *victim =
+        &batch->queues[(worker->index + i) % batch->workerCount];
+
+    pthread_mutex_lock(&victim->lock);
+    unsigned remaining = victim->end - victim->next;
+    if (remaining == 0) {
+      pthread_mutex_unlock(&victim->lock);
+      continue;
+    }
+    // Leave the victim the front half, which it's about to run, and run the
+    // first of the stolen jobs ourselves.
+    unsigned stolen = victim->end - (remaining + 1) / 2;
+    unsigned end = victim->end;
+    victim->end = stolen;
+    pthread_mutex_unlock(&victim->lock);
+
+    pthread_mutex_lock(&own->lock);
+    own->next = stolen + 1;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    return (int)stolen;
+  }
+
+  return -1;
+}
+
+static void *runWorker(void *argument) {
+  Worker *worker = argument;
+  Batch *batch = worker->batch;
+
+  for (int index = takeJob(worker); index >= 0; index = takeJob(worker)) {
+    Job *job = &batch->jobs[index];
+    runJob(job, batch->jit, batch->cacheDir);
+
+    pthread_mutex_lock(&batch->doneLock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->jobDone);
+    pthread_mutex_unlock(&batch->doneLock);
+  }
+  return NULL;
+}
+
+// Splits the manifest into jobs in place. Returns the number of jobs.
+static unsigned parseManifest(char *manifest, Job **jobs) {
+  unsigned count = 0;
+  unsigned capacity = 0;
+  *jobs = NULL;
+
+  for (char *line = strtok(manifest, "\r\n"); line != NULL;
+       line = strtok(NULL, "\r\n")) {
+    if (count == capacity) {
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      *jobs = realloc(*jobs, sizeof(Job) * capacity);
+      if (*jobs == NULL)
+        exit(1);
+    }
+    (*jobs)[count++] = (Job){.path = line};
+  }
+  return count;
+}
+
+// Writes out the job's captured streams and frees them.
+static void writeJob(Job *job) {
+  fwrite(job->out, 1, job->outLength, stdout);
+  fflush(stdout);
+  fwrite(job->err, 1, job->errLength, stderr);
+  if (job->exitCode != 0)
+    fprintf(stderr, "\"%s\" failed with exit code %d.\n", job->path,
+            job->exitCode);
+  free(job->out);
+  free(job->err);
+}
+
+int runBatch(const char *manifestPath, unsigned threadCount, bool jit,
+             const char *cacheDir) {
+  char *manifest = readFile(manifestPath, stderr);
+  if (manifest == NULL)
+    return EX_NOINPUT;
+
+  Batch batch;
+  batch.jobCount = parseManifest(manifest, &batch.jobs);
+  batch.jit = jit;
+  batch.cacheDir = cacheDir;
+
+  if (threadCount == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cores > 0 ? (unsigned)cores : 1;
+  }
+  if (threadCount > batch.jobCount)
+    threadCount = batch.jobCount > 0 ? batch.jobCount : 1;
+  batch.workerCount = threadCount;
+
+  batch.queues = malloc(sizeof(WorkQueue) * threadCount);
+  Worker *workers = malloc(sizeof(Worker) * threadCount);
+  pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+  if (batch.queues == NULL || workers == NULL || threads == NULL)
+    exit(1);
+
+  pthread_mutex_init(&batch.doneLock, NULL);
+  pthread_cond_init(&batch.jobDone, NULL);
+  for (unsigned i = 0; i < threadCount; ++i) {
+    WorkQueue *queue = &batch.queues[i];
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->next = (unsigned)((uint64_t)batch.jobCount * i / threadCount);
+    queue->end = (unsigned)((uint64_t)batch.jobCount * (i + 1) / threadCount);
+    workers[i] = (Worker){&batch, i};
+  }
+
+  for (unsigned i = 0; i < threadCount; ++i) {
+    if (pthread_create(&threads[i], NULL, runWorker, &workers[i]) != 0) {
+      fputs("Could not start batch threads.\n", stderr);
+      exit(EX_OSERR);
+    }
+  }
+
+  // Write out each job as soon as it and every job before it are done.
+  int exitCode = 0;
+  for (unsigned i = 0; i < batch.jobCount; ++i) {
+    Job *job = &batch.jobs[i];
+    pthread_mutex_lock(&batch.doneLock);
+    while (!job->done)
+      pthread_cond_wait(&batch.jobDone, &batch.doneLock);
+    pthread_mutex_unlock(&batch.doneLock);
+
+    writeJob(job);
+    if (exitCode == 0)
+      exitCode = job->exitCode;
+  }
+
+  for (unsigned i = 0; i < threadCount; ++i) {
+    pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch.queues[i].lock);
+  }
+  pthread_cond_destroy(&batch.jobDone);
+  pthread_mutex_destroy(&batch.doneLock);
+
+  free(threads);
+  free(workers);
+  free(batch.queues);
+  free(batch.jobs);
+  free(manifest);
+  return exitCode;
+}
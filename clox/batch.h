@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+// Batch mode runs every script listed in a manifest file (one path per line;
+// blank lines are skipped) within a single process. The scripts are spread
+// over a pool of threads, each script running in a fresh VM of its own, so
+// they can't see each other's globals. Every script's output and errors are
+// captured separately and written out in manifest order once it's done, so
+// the combined output is the same as running the scripts one after another.
+
+// Runs the batch on `threadCount` threads, or one per core if it's 0, with the
+// JIT if `jit` is set and caching compiled scripts in `cacheDir` if it isn't
+// NULL (see runFile). Returns the exit code of the first script in the
+// manifest that failed, or 0 if they all succeeded.
+int runBatch(const char *manifestPath, unsigned threadCount, bool jit,
+             const char *cacheDir);
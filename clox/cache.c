@@ -0,0 +1,381 @@
+// mkstemp and fdopen are POSIX, not C.
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// A cache file is the header, followed by:
+//
+// - the code, as-is;
+// - the line table, as-is;
+// - the constant pool, each constant being a tag byte and its payload;
+// - the names of the globals, indexed by the slots the code refers to them by.
+//
+// Everything is in native byte order and unaligned, since caches never leave
+// the machine that wrote them. A magic number written in the wrong byte order
+// won't match, so a foreign cache just looks invalid.
+#define CACHE_MAGIC 0x434f584c // "LOXC"
+// Bump this whenever the format, the instruction set or the way the source is
+// hashed changes.
+#define CACHE_VERSION 4
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t opcodeCount;
+  uint32_t sourceLength;
+  uint64_t sourceHash;
+  uint32_t codeCount;
+  uint32_t lineRunCount;
+  uint32_t constantCount;
+  uint32_t globalCount;
+} CacheHeader;
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+} ConstantTag;
+
+static CacheHeader headerFor(const char *source) {
+  size_t length = strlen(source);
+  return (CacheHeader){
+      .magic = CACHE_MAGIC,
+      .version = CACHE_VERSION,
+      .opcodeCount = OPCODE_COUNT,
+      .sourceLength = (uint32_t)length,
+      // This only has to catch edits, not adversaries.
+      .sourceHash = hashBytes(source, length),
+  };
+}
+
+// Loading.
+
+typedef struct {
+  VM *vm;
+  const uint8_t *current;
+  const uint8_t *end;
+  bool failed;
+} Reader;
+
+static void readBytes(Reader *reader, void *bytes, size_t count) {
+  if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+    reader->failed = true;
+    memset(bytes, 0, count);
+    return;
+  }
+
+  memcpy(bytes, reader->current, count);
+  reader->current += count;
+}
+
+static uint8_t readU8(Reader *reader) {
+  uint8_t byte;
+  readBytes(reader, &byte, sizeof(byte));
+  return byte;
+}
+
+static uint32_t readU32(Reader *reader) {
+  uint32_t word;
+  readBytes(reader, &word, sizeof(word));
+  return word;
+}
+
+// Returns a string pointing into the file, or NULL if it runs off the end.
+static const char *readString(Reader *reader, uint32_t *length) {
+  *length = readU32(reader);
+  if (reader->failed || (size_t)(reader->end - reader->current) < *length) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const char *chars = (const char *)reader->current;
+  reader->current += *length;
+  return chars;
+}
+
+// The runs must start at the beginning of the code and stay within it.
+static bool readLines(Reader *reader, Chunk *chunk, uint32_t runCount) {
+  if (runCount == 0 || runCount > chunk->count)
+    return false;
+
+  LineTable *lines = &chunk->lines;
+  lines->capacity = runCount;
+  lines->count = runCount;
+  lines->runs = ALLOCATE(reader->vm, MEM_LINES, LineRun, runCount);
+  readBytes(reader, lines->runs, sizeof(LineRun) * runCount);
+  if (reader->failed || lines->runs[0].offset != 0)
+    return false;
+
+  for (uint32_t i = 1; i < runCount; ++i) {
+    if (lines->runs[i].offset <= lines->runs[i - 1].offset ||
+        lines->runs[i].offset >= chunk->count)
+      return false;
+  }
+  return true;
+}
+
+static bool readConstants(Reader *reader, Chunk *chunk, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    Value value;
+    switch (readU8(reader)) {
+    case CONSTANT_NIL:
+      value = nilVal();
+      break;
+    case CONSTANT_FALSE:
+      value = boolVal(false);
+      break;
+    case CONSTANT_TRUE:
+      value = boolVal(true);
+      break;
+    case CONSTANT_NUMBER: {
+      double number;
+      readBytes(reader, &number, sizeof(number));
+      value = numberVal(number);
+      break;
+    }
+    case CONSTANT_STRING: {
+      uint32_t length;
+      const char *chars = readString(reader, &length);
+      if (chars == NULL)
+        return false;
+      value = OBJ_VAL(copyString(reader->vm, chars, length));
+      break;
+    }
+    default:
+      return false;
+    }
+
+    if (reader->failed)
+      return false;
+    addConstant(reader->vm, chunk, value);
+  }
+  return true;
+}
+
+// Resolves the globals, and maps the slots they had when the cache was written
+// to the slots they have now. The map is left NULL if every global got its old
+// slot back (which is always the case when running a script in a fresh VM),
+// since then the code doesn't need fixing up.
+static bool readGlobals(Reader *reader, uint32_t count, unsigned **slots) {
+  *slots = NULL;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t length;
+    const char *chars = readString(reader, &length);
+    if (chars == NULL) {
+      free(*slots);
+      return false;
+    }
+
+    ObjString *name = copyString(reader->vm, chars, length);
+    unsigned slot = resolveGlobal(reader->vm, name);
+    if (slot != i && *slots == NULL) {
+      *slots = malloc(sizeof(unsigned) * count);
+      if (*slots == NULL)
+        exit(1);
+      for (uint32_t j = 0; j < i; ++j)
+        (*slots)[j] = j;
+    }
+    if (*slots != NULL)
+      (*slots)[i] = slot;
+  }
+  return true;
+}
+
+// Checks that every operand that indexes into the chunk's tables or jumps
+// somewhere is in range, and points global operands at their current slots.
+static bool fixUpCode(Chunk *chunk, uint32_t globalCount,
+                      const unsigned *slots) {
+  unsigned offset = 0;
+  while (offset < chunk->count) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction >= OPCODE_COUNT)
+      return false;
+
+    unsigned length = instructionLength(instruction);
+    if (length > chunk->count - offset)
+      return false;
+
+    uint8_t *operands = &chunk->code[offset + 1];
+    switch ((OpCode)instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_ADD:
+      if (operands[0] >= chunk->constants.count)
+        return false;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+      if (jumpTarget(chunk, offset) >= chunk->count)
+        return false;
+      break;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL: {
+      unsigned slot = (unsigned)(operands[0] << 8) | operands[1];
+      if (slot >= globalCount)
+        return false;
+      if (slots != NULL) {
+        slot = slots[slot];
+        if (slot > UINT16_MAX)
+          return false;
+        operands[0] = (uint8_t)(slot >> 8);
+        operands[1] = (uint8_t)slot;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    offset += length;
+  }
+  return true;
+}
+
+static bool readChunk(Reader *reader, const char *source, Chunk *chunk) {
+  CacheHeader header;
+  readBytes(reader, &header, sizeof(header));
+  CacheHeader expected = headerFor(source);
+  if (reader->failed || header.magic != expected.magic ||
+      header.version != expected.version ||
+      header.opcodeCount != expected.opcodeCount ||
+      header.sourceLength != expected.sourceLength ||
+      header.sourceHash != expected.sourceHash || header.codeCount == 0 ||
+      header.codeCount > (size_t)(reader->end - reader->current))
+    return false;
+
+  chunk->capacity = header.codeCount;
+  chunk->count = header.codeCount;
+  chunk->code = ALLOCATE(reader->vm, MEM_CODE, uint8_t, header.codeCount);
+  readBytes(reader, chunk->code, header.codeCount);
+
+  if (!readLines(reader, chunk, header.lineRunCount) ||
+      !readConstants(reader, chunk, header.constantCount))
+    return false;
+
+  unsigned *slots;
+  if (!readGlobals(reader, header.globalCount, &slots))
+    return false;
+  bool valid = fixUpCode(chunk, header.globalCount, slots);
+  free(slots);
+  return valid;
+}
+
+bool loadCachedChunk(VM *vm, const char *path, const char *source,
+                     Chunk *chunk) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t)info.st_size;
+  void *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    return false;
+
+  Reader reader = {vm, file, (const uint8_t *)file + size, false};
+  bool loaded = readChunk(&reader, source, chunk);
+  munmap(file, size);
+
+  if (!loaded)
+    freeChunk(vm, chunk);
+  return loaded;
+}
+
+// Writing.
+
+static void writeU8(FILE *file, uint8_t byte) { fwrite(&byte, 1, 1, file); }
+
+static void writeU32(FILE *file, uint32_t word) {
+  fwrite(&word, sizeof(word), 1, file);
+}
+
+static void writeString(FILE *file, ObjString *string) {
+  writeU32(file, string->length);
+  fwrite(string->chars, 1, string->length, file);
+}
+
+static void writeConstant(FILE *file, Value value) {
+  if (isNil(value)) {
+    writeU8(file, CONSTANT_NIL);
+  } else if (isBool(value)) {
+    writeU8(file, asBool(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+  } else if (isNumber(value)) {
+    double number = asNumber(value);
+    writeU8(file, CONSTANT_NUMBER);
+    fwrite(&number, sizeof(number), 1, file);
+  } else {
+    writeU8(file, CONSTANT_STRING);
+    writeString(file, asString(value));
+  }
+}
+
+void writeCachedChunk(VM *vm, const char *path, const char *source,
+                      Chunk *chunk) {
+  // Write to a temporary file and move it into place, so that a concurrent
+  // run never sees half a cache. The temporary file gets a unique name, since
+  // a batch can run the same script on several threads at once.
+  size_t pathLength = strlen(path);
+  char *temporaryPath = malloc(pathLength + sizeof(".XXXXXX"));
+  if (temporaryPath == NULL)
+    return;
+  memcpy(temporaryPath, path, pathLength);
+  memcpy(temporaryPath + pathLength, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(temporaryPath);
+  if (fd < 0) {
+    free(temporaryPath);
+    return;
+  }
+  FILE *file = fdopen(fd, "wb");
+  if (file == NULL) {
+    close(fd);
+    remove(temporaryPath);
+    free(temporaryPath);
+    return;
+  }
+
+  // The code refers to globals by slot, and every slot in use belongs to a
+  // global this script declared or referenced, so saving all of their names
+  // covers everything the code needs.
+  CacheHeader header = headerFor(source);
+  header.codeCount = chunk->count;
+  header.lineRunCount = chunk->lines.count;
+  header.constantCount = chunk->constants.count;
+  header.globalCount = vm->globalNames.count;
+  fwrite(&header, sizeof(header), 1, file);
+
+  fwrite(chunk->code, 1, chunk->count, file);
+  fwrite(chunk->lines.runs, sizeof(LineRun), chunk->lines.count, file);
+  for (unsigned i = 0; i < chunk->constants.count; ++i)
+    writeConstant(file, chunk->constants.values[i]);
+  for (unsigned i = 0; i < vm->globalNames.count; ++i)
+    writeString(file, asString(vm->globalNames.values[i]));
+
+  bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed || rename(temporaryPath, path) != 0)
+    remove(temporaryPath);
+  free(temporaryPath);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+
+// Compiled scripts can be cached on disk (as .loxc files in the directory given
+// by --cache-dir, see runFile), so that running an unchanged script again skips
+// scanning and compiling. A cache is keyed by a hash of the source, and one
+// that doesn't match or can't be read is simply ignored.
+
+// Loads the cached chunk for `source` from `path` into `chunk`, which must be
+// empty. Returns false, leaving `chunk` empty, if there's no usable cache.
+// Loading allocates the constant strings, so `chunk` must be reachable by the
+// garbage collector (i.e. be vm->compilingChunk).
+bool loadCachedChunk(VM *vm, const char *path, const char *source,
+                     Chunk *chunk);
+
+// Writes `chunk`, which must have just been compiled from `source` and not run
+// yet, to `path`. Failing to write the cache isn't an error.
+void writeCachedChunk(VM *vm, const char *path, const char *source,
+                      Chunk *chunk);
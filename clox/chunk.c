@@ -2,39 +2,153 @@
 
 #include <stdlib.h>
 
+#include "jit.h"
 #include "memory.h"
+#include "tracejit.h"
+
+void initLineTable(LineTable *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->runs = NULL;
+}
+
+void freeLineTable(VM *vm, LineTable *table) {
+  FREE_ARRAY(vm, MEM_LINES, LineRun, table->runs, table->capacity);
+  initLineTable(table);
+}
+
+void writeLine(VM *vm, LineTable *table, unsigned offset, unsigned line) {
+  if (table->count > 0 && table->runs[table->count - 1].line == line)
+    return;
+
+  if (table->capacity < table->count + 1) {
+    unsigned oldCapacity = table->capacity;
+    table->capacity = GROW_CAPACITY(oldCapacity);
+    table->runs = GROW_ARRAY(vm, MEM_LINES, LineRun, table->runs, oldCapacity,
+                             table->capacity);
+  }
+
+  table->runs[table->count++] = (LineRun){offset, line};
+}
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
-  chunk->lines = NULL;
+  initLineTable(&chunk->lines);
   initValueArray(&chunk->constants);
+  chunk->jitCode = NULL;
+  chunk->jitCodeSize = 0;
+  chunk->hotLoops = NULL;
+  chunk->hotLoopCount = 0;
+  chunk->hotLoopCapacity = 0;
 }
 
-void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(unsigned, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
+void freeChunk(VM *vm, Chunk *chunk) {
+  FREE_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+  freeLineTable(vm, &chunk->lines);
+  freeValueArray(vm, MEM_CONSTANTS, &chunk->constants);
+  freeJitCode(chunk);
+  freeHotLoops(vm, chunk);
   initChunk(chunk);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, unsigned line) {
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, unsigned line) {
   if (chunk->capacity < chunk->count + 1) {
     unsigned oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines =
-        GROW_ARRAY(unsigned, chunk->lines, oldCapacity, chunk->capacity);
+    chunk->code = GROW_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, oldCapacity,
+                             chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+  writeLine(vm, &chunk->lines, chunk->count, line);
   ++chunk->count;
 }
 
-unsigned addConstant(Chunk *chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
+void truncateChunk(Chunk *chunk, unsigned start) {
+  // writeLine only ever appends, so the runs have to stay sorted by offset for
+  // getLine's binary search.
+  LineTable *lines = &chunk->lines;
+  while (lines->count > 0 && lines->runs[lines->count - 1].offset >= start)
+    --lines->count;
+  chunk->count = start;
+}
+
+unsigned addConstant(VM *vm, Chunk *chunk, Value value) {
+  writeValueArray(vm, MEM_CONSTANTS, &chunk->constants, value);
   return chunk->constants.count - 1;
 }
+
+unsigned getLine(Chunk *chunk, unsigned offset) {
+  // Find the last run that starts at or before the offset.
+  LineRun *runs = chunk->lines.runs;
+  unsigned low = 0;
+  unsigned high = chunk->lines.count;
+  while (high - low > 1) {
+    unsigned middle = low + (high - low) / 2;
+    if (runs[middle].offset <= offset)
+      low = middle;
+    else
+      high = middle;
+  }
+  return runs[low].line;
+}
+
+unsigned instructionLength(uint8_t instruction) {
+  switch ((OpCode)instruction) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESS_EQUAL:
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_PRINT:
+  case OP_RETURN:
+    return 1;
+
+  case OP_CONSTANT:
+  case OP_POP_N:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CONSTANT_ADD:
+    return 2;
+
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_ADD_LOCALS:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    return 3;
+  }
+
+  // Not a valid opcode; treat it as a single byte so callers still advance.
+  return 1;
+}
+
+unsigned jumpTarget(Chunk *chunk, unsigned offset) {
+  uint8_t *code = &chunk->code[offset];
+  unsigned distance = (unsigned)(code[1] << 8) | code[2];
+  if (code[0] == OP_LOOP)
+    return offset + 3 - distance;
+  return offset + 3 + distance;
+}
@@ -3,39 +3,103 @@
 #include "common.h"
 #include "value.h"
 
-typedef enum {
-  OP_CONSTANT,
-  OP_NIL,
-  OP_TRUE,
-  OP_FALSE,
-  OP_POP,
-  OP_GET_LOCAL,
-  OP_SET_LOCAL,
-  OP_GET_GLOBAL,
-  OP_DEFINE_GLOBAL,
-  OP_SET_GLOBAL,
-  OP_EQUAL,
-  OP_GREATER,
-  OP_LESS,
-  OP_ADD,
-  OP_SUBTRACT,
-  OP_MULTIPLY,
-  OP_DIVIDE,
-  OP_NOT,
-  OP_NEGATE,
-  OP_PRINT,
-  OP_RETURN,
-} OpCode;
+// An X macro (see scanner.h) so that the VM can build its dispatch table from
+// the same list as the enum.
+#define OPCODES                                                                \
+  X(CONSTANT)                                                                  \
+  X(NIL)                                                                       \
+  X(TRUE)                                                                      \
+  X(FALSE)                                                                     \
+  X(POP)                                                                       \
+  X(POP_N)                                                                     \
+  X(GET_LOCAL)                                                                 \
+  X(SET_LOCAL)                                                                 \
+  X(GET_GLOBAL)                                                                \
+  X(DEFINE_GLOBAL)                                                             \
+  X(SET_GLOBAL)                                                                \
+  X(EQUAL)                                                                     \
+  X(NOT_EQUAL)                                                                 \
+  X(GREATER)                                                                   \
+  X(GREATER_NUM)                                                               \
+  X(GREATER_EQUAL)                                                             \
+  X(LESS)                                                                      \
+  X(LESS_NUM)                                                                  \
+  X(LESS_EQUAL)                                                                \
+  X(ADD)                                                                       \
+  X(ADD_NUM)                                                                   \
+  X(ADD_STR)                                                                   \
+  X(ADD_LOCALS)                                                                \
+  X(CONSTANT_ADD)                                                              \
+  X(SUBTRACT)                                                                  \
+  X(SUBTRACT_NUM)                                                              \
+  X(MULTIPLY)                                                                  \
+  X(MULTIPLY_NUM)                                                              \
+  X(DIVIDE)                                                                    \
+  X(DIVIDE_NUM)                                                                \
+  X(NOT)                                                                       \
+  X(NEGATE)                                                                    \
+  X(PRINT)                                                                     \
+  X(JUMP)                                                                      \
+  X(JUMP_IF_FALSE)                                                             \
+  X(LOOP)                                                                      \
+  X(RETURN)
+
+#define X(op) OP_##op,
+typedef enum { OPCODES } OpCode;
+#undef X
+
+#define X(op) +1
+enum { OPCODE_COUNT = 0 OPCODES };
+#undef X
+
+// Consecutive bytes usually come from the same line, so instead of a line per
+// byte, we only store where each run of bytes from one line starts. Lines are
+// only needed for error messages and disassembly, so looking one up can afford
+// a binary search.
+typedef struct {
+  unsigned offset;
+  unsigned line;
+} LineRun;
+
+typedef struct {
+  unsigned count;
+  unsigned capacity;
+  LineRun *runs;
+} LineTable;
 
 typedef struct {
   unsigned count;
   unsigned capacity;
   uint8_t *code;
-  unsigned *lines;
+  LineTable lines;
   ValueArray constants;
+  // The chunk compiled to machine code by the JIT (see jit.h), once it's been
+  // run with the JIT enabled.
+  void *jitCode;
+  size_t jitCodeSize;
+  // Every loop header the tracing JIT (see tracejit.h) has counted, sorted by
+  // offset, with its trace once it has one.
+  struct HotLoop *hotLoops;
+  unsigned hotLoopCount;
+  unsigned hotLoopCapacity;
 } Chunk;
 
+void initLineTable(LineTable *table);
+void freeLineTable(VM *vm, LineTable *table);
+// Records that the byte at `offset`, which must come after every byte recorded
+// so far, is from `line`.
+void writeLine(VM *vm, LineTable *table, unsigned offset, unsigned line);
+
 void initChunk(Chunk *chunk);
-void freeChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, unsigned line);
-unsigned addConstant(Chunk *chunk, Value value);
+void freeChunk(VM *vm, Chunk *chunk);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, unsigned line);
+// Drops every byte from `start` on, along with their lines, so that the next
+// byte written goes at `start`.
+void truncateChunk(Chunk *chunk, unsigned start);
+unsigned addConstant(VM *vm, Chunk *chunk, Value value);
+unsigned getLine(Chunk *chunk, unsigned offset);
+unsigned instructionLength(uint8_t instruction);
+// Where the jump instruction at `offset` goes. Jump operands are 16-bit
+// big-endian distances from the end of the instruction, forward for OP_JUMP and
+// OP_JUMP_IF_FALSE and backward for OP_LOOP.
+unsigned jumpTarget(Chunk *chunk, unsigned offset);
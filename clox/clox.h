@@ -0,0 +1,19 @@
+#pragma once
+
+// The embedding API. Link against the libclox target and include this header.
+//
+// A host owns its VMs: initVM sets one up and freeVM tears it down, and VMs
+// share nothing, so each thread can have its own. To avoid compiling the same
+// source over and over, compile it once with compileScript and run the
+// resulting Script as often as needed with runScript, calling resetGlobals in
+// between for a clean slate. defineGlobal hands host data to scripts as
+// global variables: numbers and booleans via numberVal and boolVal, and
+// strings via copyString. Scripts print to the VM's out stream and report
+// errors to its err stream, which the host can point anywhere. vm->memory
+// counts what the VM has allocated, by category (see memstats.h), and
+// printMemoryStats formats it.
+
+#include "memstats.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
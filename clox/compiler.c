@@ -5,20 +5,15 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT, // =
@@ -33,14 +28,6 @@ typedef enum {
   PREC_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
-
-typedef struct {
-  ParseFn prefix;
-  ParseFn infix;
-  Precedence precedence;
-} ParseRule;
-
 typedef struct {
   Token name;
   unsigned depth;
@@ -50,126 +37,251 @@ typedef struct {
   Local locals[UINT8_COUNT];
   unsigned localCount;
   unsigned scopeDepth;
+  // Where the most recently emitted constant load is. If it ends where the
+  // chunk currently ends, the expression we just compiled was a compile-time
+  // constant, which is what constant folding keys off of.
+  unsigned constantStart;
+  unsigned constantEnd;
 } Compiler;
 
-static Parser parser;
-static Compiler *current = NULL;
-static Chunk *compilingChunk;
+// Everything a single compilation needs, so that several VMs can compile at
+// once.
+typedef struct {
+  VM *vm;
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+  Compiler *compiler;
+  Chunk *chunk;
+} Parser;
+
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
+
+typedef struct {
+  ParseFn prefix;
+  ParseFn infix;
+  Precedence precedence;
+} ParseRule;
 
-static Chunk *currentChunk() { return compilingChunk; }
+static Chunk *currentChunk(Parser *parser) { return parser->chunk; }
 
-static void errorAt(Token *token, const char *message) {
-  if (parser.panicMode)
+static void errorAt(Parser *parser, Token *token, const char *message) {
+  if (parser->panicMode)
     return;
 
-  parser.panicMode = true;
-  fprintf(stderr, "[line %u] Error", token->line);
+  parser->panicMode = true;
+  FILE *err = parser->vm->err;
+  fprintf(err, "[line %u] Error", token->line);
 
   if (token->type == TOKEN_EOF)
-    fprintf(stderr, " at end");
+    fprintf(err, " at end");
   else if (token->type != TOKEN_ERROR)
-    fprintf(stderr, " at '%.*s'", (int)token->length, token->start);
+    fprintf(err, " at '%.*s'", (int)token->length, token->start);
 
-  fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  fprintf(err, ": %s\n", message);
+  parser->hadError = true;
 }
 
-static void error(const char *message) { errorAt(&parser.previous, message); }
+static void error(Parser *parser, const char *message) {
+  errorAt(parser, &parser->previous, message);
+}
 
-static void errorAtCurrent(const char *message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser *parser, const char *message) {
+  errorAt(parser, &parser->current, message);
 }
 
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
 
   while (true) {
-    parser.current = scanToken();
-    if (!check(TOKEN_ERROR))
+    parser->current = scanToken(&parser->scanner);
+    if (!check(parser, TOKEN_ERROR))
       break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char *message) {
-  if (check(type)) {
-    advance();
+static void consume(Parser *parser, TokenType type, const char *message) {
+  if (check(parser, type)) {
+    advance(parser);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
-static bool match(TokenType type) {
-  if (!check(type))
+static bool match(Parser *parser, TokenType type) {
+  if (!check(parser, type))
     return false;
 
-  advance();
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser *parser, uint8_t byte) {
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
+}
+
+// Global slots are 16-bit big-endian operands.
+static void emitGlobal(Parser *parser, uint8_t op, uint16_t slot) {
+  emitByte(parser, op);
+  emitBytes(parser, (slot >> 8) & 0xff, slot & 0xff);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+// Emits a forward jump with a placeholder distance, and returns where the
+// distance goes, to patch once the target has been emitted.
+static unsigned emitJump(Parser *parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitBytes(parser, 0xff, 0xff);
+  return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn() { emitByte(OP_RETURN); }
+static void emitLoop(Parser *parser, unsigned loopStart) {
+  emitByte(parser, OP_LOOP);
 
-static uint8_t makeConstant(Value value) {
-  unsigned constant = addConstant(currentChunk(), value);
+  // +2 for the distance's own bytes.
+  unsigned distance = currentChunk(parser)->count - loopStart + 2;
+  if (distance > UINT16_MAX)
+    error(parser, "Loop body too large.");
+
+  emitBytes(parser, (distance >> 8) & 0xff, distance & 0xff);
+}
+
+static void emitReturn(Parser *parser) { emitByte(parser, OP_RETURN); }
+
+static uint8_t makeConstant(Parser *parser, Value value) {
+  unsigned constant = addConstant(parser->vm, currentChunk(parser), value);
   if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
 
   return constant;
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser *parser, Value value) {
+  parser->compiler->constantStart = currentChunk(parser)->count;
+
+  // The singletons have dedicated instructions, which also keeps folded
+  // comparisons out of the constant pool.
+  if (isNil(value))
+    emitByte(parser, OP_NIL);
+  else if (isBool(value))
+    emitByte(parser, asBool(value) ? OP_TRUE : OP_FALSE);
+  else
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+
+  parser->compiler->constantEnd = currentChunk(parser)->count;
+}
+
+// The value loaded by the constant load at `offset`. We always read it back
+// out of the chunk rather than holding on to a copy, since a young object in
+// the constant pool can be moved by the garbage collector.
+static Value constantAt(Parser *parser, unsigned offset) {
+  Chunk *chunk = currentChunk(parser);
+  switch (chunk->code[offset]) {
+  case OP_NIL:
+    return nilVal();
+  case OP_TRUE:
+    return boolVal(true);
+  case OP_FALSE:
+    return boolVal(false);
+  default:
+    return chunk->constants.values[chunk->code[offset + 1]];
+  }
 }
 
-static void initCompiler(Compiler *compiler) {
+// Whether everything emitted since `start` is a single constant load.
+static bool isConstantSince(Parser *parser, unsigned start) {
+  return parser->compiler->constantStart == start &&
+         parser->compiler->constantEnd == currentChunk(parser)->count;
+}
+
+// Removes the constant load at `start`, which must be the last thing emitted,
+// along with its constant pool entry if nothing has been added after it.
+static void discardConstant(Parser *parser, unsigned start) {
+  Chunk *chunk = currentChunk(parser);
+  if (chunk->code[start] == OP_CONSTANT &&
+      chunk->code[start + 1] == chunk->constants.count - 1)
+    --chunk->constants.count;
+  truncateChunk(chunk, start);
+}
+
+// Points the jump whose distance is at `offset` to the next instruction.
+static void patchJump(Parser *parser, unsigned offset) {
+  Chunk *chunk = currentChunk(parser);
+  // -2 for the distance's own bytes.
+  unsigned distance = chunk->count - offset - 2;
+  if (distance > UINT16_MAX)
+    error(parser, "Too much code to jump over.");
+
+  chunk->code[offset] = (distance >> 8) & 0xff;
+  chunk->code[offset + 1] = distance & 0xff;
+
+  // Code can reach this point without going through the constant load that
+  // was emitted last, so that load is no longer the value of what follows.
+  parser->compiler->constantEnd = (unsigned)-1;
+}
+
+static void initCompiler(Parser *parser, Compiler *compiler) {
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
-  current = compiler;
+  compiler->constantStart = (unsigned)-1;
+  compiler->constantEnd = (unsigned)-1;
+  parser->compiler = compiler;
 }
 
-static void endCompiler() {
-  emitReturn();
+static void endCompiler(Parser *parser) {
+  emitReturn(parser);
+  if (!parser->hadError)
+    optimizeChunk(parser->vm, currentChunk(parser));
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError)
-    disassembleChunk(currentChunk(), "code");
+  if (!parser->hadError)
+    disassembleChunk(parser->vm, currentChunk(parser), "code");
 #endif
 }
 
-static void beginScope() { ++current->scopeDepth; }
+static void beginScope(Parser *parser) { ++parser->compiler->scopeDepth; }
 
-static void endScope() {
-  --current->scopeDepth;
+static void endScope(Parser *parser) {
+  --parser->compiler->scopeDepth;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    emitByte(OP_POP);
-    --current->localCount;
+  Compiler *compiler = parser->compiler;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->scopeDepth) {
+    emitByte(parser, OP_POP);
+    --compiler->localCount;
   }
 }
 
-static void expression(void);
-static void statement(void);
-static void declaration(void);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint16_t identifierSlot(Parser *parser, Token *name) {
+  unsigned slot = resolveGlobal(
+      parser->vm, copyString(parser->vm, name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -178,12 +290,12 @@ static bool identifiersEqual(Token *a, Token *b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name) {
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
   for (int i = compiler->localCount - 1; i >= 0; --i) {
     Local *local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == (unsigned)-1)
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       return i;
     }
   }
@@ -191,24 +303,24 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Parser *parser, Token name) {
+  if (parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = &parser->compiler->locals[parser->compiler->localCount++];
   local->name = name;
   local->depth = -1;
 }
 
-static void declareVariable() {
-  if (current->scopeDepth == 0)
+static void declareVariable(Parser *parser) {
+  if (parser->compiler->scopeDepth == 0)
     return;
 
-  Token *name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; --i) {
-    Local *local = &current->locals[i];
+  Token *name = &parser->previous;
+  for (int i = parser->compiler->localCount - 1; i >= 0; --i) {
+    Local *local = &parser->compiler->locals[i];
 
     // Absolutely unnecessary optimization alert: the book's condition is
     // `local->depth != -1 && local->depth < current->scopeDepth`. Our depth
@@ -218,154 +330,275 @@ static void declareVariable() {
     // would be enough, because the other would be promoted to unsigned in that
     // case. gcc and clang are smart enough to recognize this themselves, but
     // MSVC isn't currently: https://godbolt.org/z/Kdj4c4bbs.
-    if (local->depth < current->scopeDepth)
+    if (local->depth < parser->compiler->scopeDepth)
       break;
 
     if (identifiersEqual(name, &local->name))
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
   }
 
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static uint16_t parseVariable(Parser *parser, const char *errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable();
-  if (current->scopeDepth > 0)
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0)
     return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierSlot(parser, &parser->previous);
 }
 
-static void markInitialized() {
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser *parser, uint16_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static void binary(__attribute__((unused)) bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+// Evaluates `a <op> b` at compile time. Returns false if the operation has to
+// be left to the VM, either because it isn't foldable or because it would fail
+// at runtime (in which case the runtime error is what the user should see).
+static bool foldBinary(Parser *parser, TokenType operatorType, Value a,
+                       Value b, Value *result) {
+  switch (operatorType) {
+  case TOKEN_BANG_EQUAL:
+    *result = boolVal(!valuesEqual(parser->vm, a, b));
+    return true;
+  case TOKEN_EQUAL_EQUAL:
+    *result = boolVal(valuesEqual(parser->vm, a, b));
+    return true;
+  case TOKEN_PLUS:
+    if (isString(a) && isString(b)) {
+      *result =
+          OBJ_VAL(concatenateStrings(parser->vm, asString(a), asString(b)));
+      return true;
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (!isNumber(a) || !isNumber(b))
+    return false;
+
+  double x = asNumber(a);
+  double y = asNumber(b);
+  switch (operatorType) {
+  // These mirror the runtime's !(a < b) and !(a > b), which differ from >= and
+  // <= for NaN.
+  case TOKEN_GREATER:
+    *result = boolVal(x > y);
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *result = boolVal(!(x < y));
+    return true;
+  case TOKEN_LESS:
+    *result = boolVal(x < y);
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *result = boolVal(!(x > y));
+    return true;
+  case TOKEN_PLUS:
+    *result = numberVal(x + y);
+    return true;
+  case TOKEN_MINUS:
+    *result = numberVal(x - y);
+    return true;
+  case TOKEN_STAR:
+    *result = numberVal(x * y);
+    return true;
+  case TOKEN_SLASH:
+    *result = numberVal(x / y);
+    return true;
+  default:
+    __builtin_unreachable();
+  }
+}
+
+static void binary(Parser *parser, __attribute__((unused)) bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule *rule = getRule(operatorType);
-  parsePrecedence(rule->precedence + 1);
+
+  // An expression that ends in a constant load can only be that constant, since
+  // every compound expression ends with its own operator.
+  unsigned leftStart = parser->compiler->constantStart;
+  bool leftIsConstant = isConstantSince(parser, leftStart);
+
+  unsigned rightStart = currentChunk(parser)->count;
+  parsePrecedence(parser, rule->precedence + 1);
+
+  Value folded;
+  if (leftIsConstant && isConstantSince(parser, rightStart) &&
+      foldBinary(parser, operatorType, constantAt(parser, leftStart),
+                 constantAt(parser, rightStart), &folded)) {
+    discardConstant(parser, rightStart);
+    discardConstant(parser, leftStart);
+    emitConstant(parser, folded);
+    return;
+  }
 
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    emitBytes(parser, OP_EQUAL, OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitByte(OP_EQUAL);
+    emitByte(parser, OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    emitByte(parser, OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    emitBytes(parser, OP_LESS, OP_NOT);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    emitByte(parser, OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    emitBytes(parser, OP_GREATER, OP_NOT);
     break;
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    emitByte(parser, OP_ADD);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    emitByte(parser, OP_SUBTRACT);
     break;
   case TOKEN_STAR:
-    emitByte(OP_MULTIPLY);
+    emitByte(parser, OP_MULTIPLY);
     break;
   case TOKEN_SLASH:
-    emitByte(OP_DIVIDE);
+    emitByte(parser, OP_DIVIDE);
     break;
   default:
     __builtin_unreachable();
   }
 }
 
-static void literal(__attribute__((unused)) bool canAssign) {
-  switch (parser.previous.type) {
+static void literal(Parser *parser, __attribute__((unused)) bool canAssign) {
+  switch (parser->previous.type) {
   case TOKEN_FALSE:
-    emitByte(OP_FALSE);
+    emitConstant(parser, boolVal(false));
     break;
   case TOKEN_NIL:
-    emitByte(OP_NIL);
+    emitConstant(parser, nilVal());
     break;
   case TOKEN_TRUE:
-    emitByte(OP_TRUE);
+    emitConstant(parser, boolVal(true));
     break;
   default:
     __builtin_unreachable();
   }
 }
 
-static void grouping(__attribute__((unused)) bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser *parser, __attribute__((unused)) bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(__attribute__((unused)) bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(numberVal(value));
+static void number(Parser *parser, __attribute__((unused)) bool canAssign) {
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, numberVal(value));
 }
 
-static void string(__attribute__((unused)) bool canAssign) {
-  emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser *parser, __attribute__((unused)) bool canAssign) {
+  ObjString *string = copyString(parser->vm, parser->previous.start + 1,
+                                 parser->previous.length - 2);
+  emitConstant(parser, OBJ_VAL(string));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
-  if (arg != -1) {
+  int arg = resolveLocal(parser, parser->compiler, &name);
+  bool isLocal = arg != -1;
+  if (isLocal) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierSlot(parser, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
-  } else {
-    emitBytes(getOp, (uint8_t)arg);
+  uint8_t op = getOp;
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    op = setOp;
   }
+
+  if (isLocal)
+    emitBytes(parser, op, (uint8_t)arg);
+  else
+    emitGlobal(parser, op, (uint16_t)arg);
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser *parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
-static void unary(__attribute__((unused)) bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser *parser, __attribute__((unused)) bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
   // Compile the operand.
-  parsePrecedence(PREC_UNARY);
+  unsigned operandStart = currentChunk(parser)->count;
+  parsePrecedence(parser, PREC_UNARY);
+
+  // Fold it if we can. Negating a non-number is left for the VM to complain
+  // about.
+  if (isConstantSince(parser, operandStart)) {
+    Value operand = constantAt(parser, operandStart);
+    if (operatorType == TOKEN_BANG) {
+      discardConstant(parser, operandStart);
+      emitConstant(parser, boolVal(isFalsey(operand)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && isNumber(operand)) {
+      discardConstant(parser, operandStart);
+      emitConstant(parser, numberVal(-asNumber(operand)));
+      return;
+    }
+  }
 
   // Emit the operator instruction.
   switch (operatorType) {
   case TOKEN_BANG:
-    emitByte(OP_NOT);
+    emitByte(parser, OP_NOT);
     break;
   case TOKEN_MINUS:
-    emitByte(OP_NEGATE);
+    emitByte(parser, OP_NEGATE);
     break;
   default:
     __builtin_unreachable();
   }
 }
 
+static void and_(Parser *parser, __attribute__((unused)) bool canAssign) {
+  unsigned endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
+
+  patchJump(parser, endJump);
+}
+
+static void or_(Parser *parser, __attribute__((unused)) bool canAssign) {
+  unsigned elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  unsigned endJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
+
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
+}
+
 // Preserve the nice hand-alignment (although there's probably some config to
 // get clang-format to do that for us too).
 // clang-format off
@@ -392,7 +625,7 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
@@ -400,7 +633,7 @@ ParseRule rules[] = {
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
@@ -413,71 +646,152 @@ ParseRule rules[] = {
 };
 // clang-format on
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser *parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
+}
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-    declaration();
+static void block(Parser *parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+    declaration(parser);
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser *parser) {
+  uint16_t global = parseVariable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL))
-    expression();
+  if (match(parser, TOKEN_EQUAL))
+    expression(parser);
   else
-    emitByte(OP_NIL);
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    emitByte(parser, OP_NIL);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void forStatement(Parser *parser) {
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
+    // No initializer.
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else {
+    expressionStatement(parser);
+  }
+
+  unsigned loopStart = currentChunk(parser)->count;
+  unsigned exitJump = (unsigned)-1;
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    // Jump out of the loop if the condition is false.
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP); // Condition.
+  }
+
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    unsigned bodyJump = emitJump(parser, OP_JUMP);
+    unsigned incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(parser, loopStart);
+    loopStart = incrementStart;
+    patchJump(parser, bodyJump);
+  }
+
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  if (exitJump != (unsigned)-1) {
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // Condition.
+  }
+
+  endScope(parser);
 }
 
-static void synchronize() {
-  parser.panicMode = false;
+static void ifStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  unsigned thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+
+  unsigned elseJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
+
+  if (match(parser, TOKEN_ELSE))
+    statement(parser);
+  patchJump(parser, elseJump);
+}
+
+static void printStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
+}
+
+static void whileStatement(Parser *parser) {
+  unsigned loopStart = currentChunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  unsigned exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
+}
+
+static void synchronize(Parser *parser) {
+  parser->panicMode = false;
 
-  while (!check(TOKEN_EOF)) {
-    if (parser.previous.type == TOKEN_SEMICOLON)
+  while (!check(parser, TOKEN_EOF)) {
+    if (parser->previous.type == TOKEN_SEMICOLON)
       return;
 
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -492,46 +806,66 @@ static void synchronize() {
       break; // Do nothing.
     }
 
-    advance();
+    advance(parser);
   }
 }
 
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+static void statement(Parser *parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 }
 
-static void declaration() {
-  if (match(TOKEN_VAR))
-    varDeclaration();
+static void declaration(Parser *parser) {
+  if (match(parser, TOKEN_VAR))
+    varDeclaration(parser);
   else
-    statement();
+    statement(parser);
 
-  if (parser.panicMode)
-    synchronize();
+  if (parser->panicMode)
+    synchronize(parser);
 }
 
-bool compile(const char *source, Chunk *chunk) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler);
-  compilingChunk = chunk;
-
+bool compile(VM *vm, const char *source, Chunk *chunk) {
+  Parser parser;
+  parser.vm = vm;
+  initScanner(&parser.scanner, source);
   parser.hadError = false;
   parser.panicMode = false;
+  parser.chunk = chunk;
+
+  Compiler compiler;
+  initCompiler(&parser, &compiler);
+  vm->compilingChunk = chunk;
 
-  advance();
+  advance(&parser);
 
-  while (!match(TOKEN_EOF))
-    declaration();
+  while (!match(&parser, TOKEN_EOF))
+    declaration(&parser);
 
-  endCompiler();
+  endCompiler(&parser);
+  vm->compilingChunk = NULL;
   return !parser.hadError;
 }
+
+void markCompilerRoots(VM *vm) {
+  if (vm->compilingChunk != NULL)
+    markArray(vm, &vm->compilingChunk->constants);
+}
+
+void forwardCompilerRoots(VM *vm) {
+  if (vm->compilingChunk != NULL)
+    forwardArray(vm, &vm->compilingChunk->constants);
+}
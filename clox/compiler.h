@@ -2,4 +2,6 @@
 
 #include "vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+bool compile(VM *vm, const char *source, Chunk *chunk);
+void markCompilerRoots(VM *vm);
+void forwardCompilerRoots(VM *vm);
@@ -3,19 +3,27 @@
 #include <stdio.h>
 
 #include "value.h"
+#include "vm.h"
 
-void disassembleChunk(Chunk *chunk, const char *name) {
+const char *opcodeName(uint8_t instruction) {
+#define X(op) [OP_##op] = "OP_" #op,
+  static const char *const names[] = {OPCODES};
+#undef X
+  return instruction < OPCODE_COUNT ? names[instruction] : "Unknown opcode";
+}
+
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
   for (unsigned offset = 0; offset < chunk->count;) {
-    offset = disassembleInstruction(chunk, offset);
+    offset = disassembleInstruction(vm, chunk, offset);
   }
 }
 
-static unsigned constantInstruction(const char *name, Chunk *chunk,
+static unsigned constantInstruction(VM *vm, const char *name, Chunk *chunk,
                                     unsigned offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4u '", name, constant);
-  printValue(chunk->constants.values[constant]);
+  printValue(vm, stdout, chunk->constants.values[constant]);
   puts("'");
   return offset + 2;
 }
@@ -31,17 +39,42 @@ static int byteInstruction(const char *name, Chunk *chunk, unsigned offset) {
   return offset + 2;
 }
 
-unsigned disassembleInstruction(Chunk *chunk, unsigned offset) {
+static unsigned twoByteInstruction(const char *name, Chunk *chunk,
+                                   unsigned offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4u %4u\n", name, first, second);
+  return offset + 3;
+}
+
+static unsigned globalInstruction(VM *vm, const char *name, Chunk *chunk,
+                                  unsigned offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4u '", name, slot);
+  printValue(vm, stdout, vm->globalNames.values[slot]);
+  puts("'");
+  return offset + 3;
+}
+
+static unsigned jumpInstruction(const char *name, Chunk *chunk,
+                                unsigned offset) {
+  printf("%-16s %4u -> %u\n", name, offset, jumpTarget(chunk, offset));
+  return offset + 3;
+}
+
+unsigned disassembleInstruction(VM *vm, Chunk *chunk, unsigned offset) {
   printf("%04u ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+  unsigned line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1))
     printf("   | ");
   else
-    printf("%4u ", chunk->lines[offset]);
+    printf("%4u ", line);
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CONSTANT:
-    return constantInstruction("OP_CONSTANT", chunk, offset);
+    return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
 
   case OP_NIL:
     return simpleInstruction("OP_NIL", offset);
@@ -55,6 +88,9 @@ unsigned disassembleInstruction(Chunk *chunk, unsigned offset) {
   case OP_POP:
     return simpleInstruction("OP_POP", offset);
 
+  case OP_POP_N:
+    return byteInstruction("OP_POP_N", chunk, offset);
+
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
 
@@ -62,35 +98,71 @@ unsigned disassembleInstruction(Chunk *chunk, unsigned offset) {
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
 
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
 
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
 
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
 
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
 
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+
   case OP_GREATER:
     return simpleInstruction("OP_GREATER", offset);
 
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+
   case OP_LESS:
     return simpleInstruction("OP_LESS", offset);
 
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
+
   case OP_ADD:
     return simpleInstruction("OP_ADD", offset);
 
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+
+  case OP_ADD_LOCALS:
+    return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+
+  case OP_CONSTANT_ADD:
+    return constantInstruction(vm, "OP_CONSTANT_ADD", chunk, offset);
+
   case OP_SUBTRACT:
     return simpleInstruction("OP_SUBTRACT", offset);
 
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+
   case OP_MULTIPLY:
     return simpleInstruction("OP_MULTIPLY", offset);
 
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", offset);
 
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset);
 
@@ -100,6 +172,15 @@ unsigned disassembleInstruction(Chunk *chunk, unsigned offset) {
   case OP_PRINT:
     return simpleInstruction("OP_PRINT", offset);
 
+  case OP_JUMP:
+    return jumpInstruction("OP_JUMP", chunk, offset);
+
+  case OP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
+
+  case OP_LOOP:
+    return jumpInstruction("OP_LOOP", chunk, offset);
+
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
 
@@ -2,5 +2,6 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk *chunk, const char *name);
-unsigned disassembleInstruction(Chunk *chunk, unsigned offset);
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name);
+unsigned disassembleInstruction(VM *vm, Chunk *chunk, unsigned offset);
+const char *opcodeName(uint8_t instruction);
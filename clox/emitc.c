@@ -0,0 +1,312 @@
+#include "emitc.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "memory.h"
+#include "object.h"
+#include "script.h"
+
+static void emitStringLiteral(FILE *out, const char *chars, unsigned length) {
+  fputc('"', out);
+  for (unsigned i = 0; i < length; ++i) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c == '\n')
+      fputs("\\n", out);
+    else if (c < ' ' || c >= 0x7f || c == '?')
+      // Octal, so that the next character can't be taken as more digits, and
+      // ? so that nothing turns into a trigraph.
+      fprintf(out, "\\%03o", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static void emitNumber(FILE *out, double number) {
+  if (isfinite(number)) {
+    // Hexadecimal floats round-trip exactly.
+    fprintf(out, "numberVal(%a)", number);
+    return;
+  }
+  // There are no literals for infinities and NaNs, and the sign of a NaN shows
+  // up when it's printed, so those go in bit for bit.
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  fprintf(out, "numberVal(aotNumberFromBits(UINT64_C(0x%016" PRIx64 ")))",
+          bits);
+}
+
+// Writes the value of constant `index`. String constants are read from the
+// constants runAot set up, which stringIndices maps them to.
+static void emitConstant(FILE *out, Chunk *chunk, unsigned *stringIndices,
+                         uint8_t index) {
+  Value value = chunk->constants.values[index];
+  if (isNumber(value))
+    emitNumber(out, asNumber(value));
+  else if (isBool(value))
+    fprintf(out, "boolVal(%s)", asBool(value) ? "true" : "false");
+  else if (isNil(value))
+    fputs("nilVal()", out);
+  else
+    fprintf(out, "constants[%u]", stringIndices[index]);
+}
+
+#define RETURN_IF_ERROR " return INTERPRET_RUNTIME_ERROR;\n"
+
+static void emitCheckNumbers(FILE *out, unsigned line) {
+  fprintf(out,
+          "  if (!aotCheckNumbers(vm, %u, \"Operands must be numbers.\"))"
+          "\n   " RETURN_IF_ERROR,
+          line);
+}
+
+static void emitBinary(FILE *out, unsigned line, const char *valueType,
+                       const char *op) {
+  emitCheckNumbers(out, line);
+  fprintf(out, "  AOT_BINARY(%s, %s);\n", valueType, op);
+}
+
+static void emitInstruction(FILE *out, Chunk *chunk, unsigned *stringIndices,
+                            unsigned offset) {
+  uint8_t *ip = &chunk->code[offset];
+  // Errors report the line of the instruction's last byte, like the
+  // interpreter, since a fused instruction's bytes can be from different lines.
+  unsigned line = getLine(chunk, offset + instructionLength(*ip) - 1);
+  uint16_t slot = 0;
+  if (instructionLength(*ip) == 3)
+    slot = (uint16_t)((ip[1] << 8) | ip[2]);
+
+  // The quickened instructions only exist to speed up the interpreter, so
+  // they're written out as their generic versions.
+  switch ((OpCode)*ip) {
+  case OP_CONSTANT:
+    fputs("  aotPush(vm, ", out);
+    emitConstant(out, chunk, stringIndices, ip[1]);
+    fputs(");\n", out);
+    break;
+  case OP_NIL:
+    fputs("  aotPush(vm, nilVal());\n", out);
+    break;
+  case OP_TRUE:
+    fputs("  aotPush(vm, boolVal(true));\n", out);
+    break;
+  case OP_FALSE:
+    fputs("  aotPush(vm, boolVal(false));\n", out);
+    break;
+  case OP_POP:
+    fputs("  aotPop(vm);\n", out);
+    break;
+  case OP_POP_N:
+    fprintf(out, "  vm->stackTop -= %u;\n", ip[1]);
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "  aotPush(vm, vm->stack[%u]);\n", ip[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "  vm->stack[%u] = aotPeek(vm, 0);\n", ip[1]);
+    break;
+  case OP_GET_GLOBAL:
+    fprintf(out, "  if (!aotGetGlobal(vm, %u, %u))" RETURN_IF_ERROR, slot,
+            line);
+    break;
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  aotDefineGlobal(vm, %u);\n", slot);
+    break;
+  case OP_SET_GLOBAL:
+    fprintf(out, "  if (!aotSetGlobal(vm, %u, %u))" RETURN_IF_ERROR, slot,
+            line);
+    break;
+  case OP_EQUAL:
+    fputs("  aotEqual(vm, false);\n", out);
+    break;
+  case OP_NOT_EQUAL:
+    fputs("  aotEqual(vm, true);\n", out);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitBinary(out, line, "boolVal", ">");
+    break;
+  case OP_GREATER_EQUAL:
+    emitBinary(out, line, "aotNotBoolVal", "<");
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitBinary(out, line, "boolVal", "<");
+    break;
+  case OP_LESS_EQUAL:
+    emitBinary(out, line, "aotNotBoolVal", ">");
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    fprintf(out, "  if (!aotAdd(vm, %u))" RETURN_IF_ERROR, line);
+    break;
+  case OP_ADD_LOCALS:
+    fprintf(out, "  aotPush(vm, vm->stack[%u]);\n", ip[1]);
+    fprintf(out, "  aotPush(vm, vm->stack[%u]);\n", ip[2]);
+    fprintf(out, "  if (!aotAdd(vm, %u))" RETURN_IF_ERROR, line);
+    break;
+  case OP_CONSTANT_ADD:
+    fputs("  aotPush(vm, ", out);
+    emitConstant(out, chunk, stringIndices, ip[1]);
+    fputs(");\n", out);
+    fprintf(out, "  if (!aotAdd(vm, %u))" RETURN_IF_ERROR, line);
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    emitBinary(out, line, "numberVal", "-");
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    emitBinary(out, line, "numberVal", "*");
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emitBinary(out, line, "numberVal", "/");
+    break;
+  case OP_NOT:
+    fputs("  aotPush(vm, boolVal(isFalsey(aotPop(vm))));\n", out);
+    break;
+  case OP_NEGATE:
+    fprintf(out, "  if (!aotNegate(vm, %u))" RETURN_IF_ERROR, line);
+    break;
+  case OP_PRINT:
+    fputs("  aotPrint(vm);\n", out);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    fprintf(out, "  goto L%u;\n", jumpTarget(chunk, offset));
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "  if (isFalsey(aotPeek(vm, 0)))\n    goto L%u;\n",
+            jumpTarget(chunk, offset));
+    break;
+  case OP_RETURN:
+    fputs("  return INTERPRET_OK;\n", out);
+    break;
+  }
+}
+
+void emitC(VM *vm, Chunk *chunk, const char *sourcePath, FILE *out) {
+  fputs("// Generated by clox --emit-c from ", out);
+  emitStringLiteral(out, sourcePath, (unsigned)strlen(sourcePath));
+  fputs(".\n// Build it with libclox's public compile definitions and link it "
+        "against\n// libclox.\n\n"
+        "#include \"aot.h\"\n\n",
+        out);
+
+  // Values and objects have to be laid out the way they were for the clox that
+  // compiled the script.
+#ifdef NAN_BOXING
+  fputs("#ifndef NAN_BOXING\n", out);
+#else
+  fputs("#ifdef NAN_BOXING\n", out);
+#endif
+  fputs("#error \"NAN_BOXING has to match the clox this came from.\"\n"
+        "#endif\n",
+        out);
+  fprintf(out,
+          "#if NURSERY_SIZE != %d\n"
+          "#error \"NURSERY_SIZE has to match the clox this came from.\"\n"
+          "#endif\n",
+          NURSERY_SIZE);
+
+  unsigned globalCount = vm->globalNames.count;
+  if (globalCount > 0) {
+    fputs("\nstatic const char *const globalNames[] = {\n", out);
+    for (unsigned slot = 0; slot < globalCount; ++slot) {
+      ObjString *name = asString(vm->globalNames.values[slot]);
+      fputs("    ", out);
+      emitStringLiteral(out, name->chars, name->length);
+      fputs(",\n", out);
+    }
+    fputs("};\n", out);
+  }
+
+  unsigned constantCount = chunk->constants.count;
+  unsigned *stringIndices = ALLOCATE(vm, MEM_COMPILER, unsigned, constantCount);
+  unsigned stringCount = 0;
+  for (unsigned i = 0; i < constantCount; ++i) {
+    Value value = chunk->constants.values[i];
+    if (!isString(value))
+      continue;
+    if (stringCount == 0)
+      fputs("\nstatic const AotString strings[] = {\n", out);
+    ObjString *string = asString(value);
+    fputs("    {", out);
+    emitStringLiteral(out, string->chars, string->length);
+    fprintf(out, ", %u},\n", string->length);
+    stringIndices[i] = stringCount++;
+  }
+  if (stringCount > 0)
+    fputs("};\n", out);
+
+  // Only jump targets get labels, since unused ones are warnings.
+  bool *isJumpTarget = ALLOCATE(vm, MEM_COMPILER, bool, chunk->count);
+  memset(isJumpTarget, 0, chunk->count);
+  for (unsigned offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    OpCode op = chunk->code[offset];
+    if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+      isJumpTarget[jumpTarget(chunk, offset)] = true;
+  }
+
+  fputs("\nstatic InterpretResult script(VM *vm, Value *constants) {\n", out);
+  if (stringCount == 0)
+    fputs("  (void)constants;\n", out);
+  unsigned line = 0;
+  for (unsigned offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (isJumpTarget[offset])
+      fprintf(out, "L%u:\n", offset);
+    if (getLine(chunk, offset) != line) {
+      line = getLine(chunk, offset);
+      fprintf(out, "  // line %u\n", line);
+    }
+    emitInstruction(out, chunk, stringIndices, offset);
+  }
+  fputs("}\n", out);
+
+  fprintf(out,
+          "\nint main(void) {\n"
+          "  return runAot(%s, %u, %s, %u, script);\n"
+          "}\n",
+          globalCount > 0 ? "globalNames" : "NULL", globalCount,
+          stringCount > 0 ? "strings" : "NULL", stringCount);
+
+  FREE_ARRAY(vm, MEM_COMPILER, bool, isJumpTarget, chunk->count);
+  FREE_ARRAY(vm, MEM_COMPILER, unsigned, stringIndices, constantCount);
+}
+
+int emitCFile(VM *vm, const char *path, const char *outputPath) {
+  char *source = readFile(path, vm->err);
+  if (source == NULL)
+    return EX_IOERR;
+
+  Script *script = compileScript(vm, source);
+  free(source);
+  if (script == NULL)
+    return EX_DATAERR;
+
+  int exitCode = 0;
+  FILE *out = fopen(outputPath, "w");
+  if (out == NULL) {
+    fprintf(vm->err, "Could not open \"%s\" for writing.\n", outputPath);
+    exitCode = EX_CANTCREAT;
+  } else {
+    emitC(vm, &script->chunk, path, out);
+    if (fclose(out) != 0) {
+      fprintf(vm->err, "Could not write \"%s\".\n", outputPath);
+      exitCode = EX_IOERR;
+    }
+  }
+
+  freeScript(vm, script);
+  return exitCode;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// Ahead-of-time compilation: `clox --emit-c` compiles a script as usual and
+// then writes its bytecode out as a C translation unit, which runs on the
+// runtime in aot.h. Build that with a C compiler and link it against libclox to
+// get a native executable that does exactly what interpreting the script would,
+// without the interpreter's decoding and dispatch.
+
+// Writes `chunk`, compiled from `sourcePath` in `vm`, to `out` as C.
+void emitC(VM *vm, Chunk *chunk, const char *sourcePath, FILE *out);
+
+// Compiles the script at `path` and writes it to `outputPath` as C. Errors go
+// to the VM's error stream. Returns the exit code clox should exit with, like
+// runFile.
+int emitCFile(VM *vm, const char *path, const char *outputPath);
@@ -0,0 +1,96 @@
+#include "hash.h"
+
+#include <string.h>
+
+// wyhash's default secret: odd constants with every byte having four bits set.
+static const uint64_t secret[] = {
+    0x2d358dccaa6c78a5u,
+    0x8bb84b93962eacc9u,
+    0x4b33a62ed433d4a3u,
+    0x4d5a2da51de1aa47u,
+};
+
+// Multiplies a and b, and replaces them with the low and high halves of the
+// product.
+static void multiply(uint64_t *a, uint64_t *b) {
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+// Unaligned reads.
+static uint64_t read8(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t read4(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Up to three bytes: the first, the middle and the last, some of which may be
+// the same byte.
+static uint64_t read3(const uint8_t *p, size_t length) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+         p[length - 1];
+}
+
+uint64_t hashBytes(const void *bytes, size_t length) {
+  const uint8_t *p = bytes;
+  uint64_t seed = mix(secret[0], secret[1]);
+  uint64_t a;
+  uint64_t b;
+
+  if (length <= 16) {
+    // Short strings are read as (possibly overlapping) words from both ends,
+    // without a loop.
+    if (length >= 4) {
+      size_t middle = (length >> 3) << 2;
+      a = (read4(p) << 32) | read4(p + middle);
+      b = (read4(p + length - 4) << 32) | read4(p + length - 4 - middle);
+    } else if (length > 0) {
+      a = read3(p, length);
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    size_t remaining = length;
+    if (remaining > 48) {
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+        seed1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ seed1);
+        seed2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (remaining > 16) {
+      seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+
+    // The last sixteen bytes, which may overlap ones already hashed.
+    a = read8(p + remaining - 16);
+    b = read8(p + remaining - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  multiply(&a, &b);
+  return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+
+// A wyhash-style hash of `length` bytes: it reads eight bytes at a time and
+// mixes them with 64x64->128-bit multiplies, and strings longer than 48 bytes
+// go through three independent lanes at once, which keeps the multiplier busy.
+// It's much faster than hashing a byte at a time for anything but the
+// shortest strings, and its output is well mixed in every bit, which the
+// tables rely on (see table.c). It isn't meant to resist adversaries.
+//
+// Words are read in native byte order, so hashes differ between machines of
+// different endianness. That's fine, since the only hashes that get stored are
+// in caches, which never leave the machine (see cache.h).
+uint64_t hashBytes(const void *bytes, size_t length);
@@ -0,0 +1,441 @@
+#include "jit.h"
+
+#include <string.h>
+
+#include "memory.h"
+#include "x64.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+// rbx holds the VM for the whole run, since calls preserve it, and rcx caches
+// vm->stackTop. The rest of the registers are scratch.
+
+typedef struct {
+  // Where a jump's rel32 is, and the offset in the chunk it goes to.
+  unsigned at;
+  unsigned target;
+} JumpPatch;
+
+typedef struct {
+  Assembler as;
+  Chunk *chunk;
+  // Where each instruction's machine code starts, indexed by its offset in
+  // the chunk, and which instructions are jump targets.
+  unsigned *nativeOffsets;
+  bool *isJumpTarget;
+  // The jumps to patch once every instruction has been emitted.
+  JumpPatch *jumps;
+  unsigned jumpCount;
+  unsigned jumpCapacity;
+  // Where the rel32 of every jump to the error exit is, so that they can be
+  // patched once the exit has been emitted at the end.
+  unsigned *errorJumps;
+  unsigned errorJumpCount;
+  unsigned errorJumpCapacity;
+  // Whether rcx holds vm->stackTop right now. vm->stackTop itself is always
+  // kept up to date, since the helpers and the collector use it.
+  bool stackTopInRcx;
+} Jit;
+
+static void emitErrorJump(Jit *jit, Condition condition) {
+  if (jit->errorJumpCapacity < jit->errorJumpCount + 1) {
+    unsigned oldCapacity = jit->errorJumpCapacity;
+    jit->errorJumpCapacity = GROW_CAPACITY(oldCapacity);
+    jit->errorJumps = GROW_ARRAY(jit->as.vm, MEM_JIT, unsigned, jit->errorJumps,
+                                 oldCapacity, jit->errorJumpCapacity);
+  }
+  jit->errorJumps[jit->errorJumpCount++] = emitJump(&jit->as, condition);
+}
+
+// Records a jump emitted at `at` to the instruction at `target`.
+static void addJump(Jit *jit, unsigned at, unsigned target) {
+  if (jit->jumpCapacity < jit->jumpCount + 1) {
+    unsigned oldCapacity = jit->jumpCapacity;
+    jit->jumpCapacity = GROW_CAPACITY(oldCapacity);
+    jit->jumps = GROW_ARRAY(jit->as.vm, MEM_JIT, JumpPatch, jit->jumps,
+                            oldCapacity, jit->jumpCapacity);
+  }
+  jit->jumps[jit->jumpCount++] = (JumpPatch){at, target};
+}
+
+// mov eax, result; pop rbx; ret
+static void emitReturn(Jit *jit, InterpretResult result) {
+  emitLoadImmediate32(&jit->as, RAX, result);
+  EMIT(&jit->as, 0x5b, 0xc3);
+}
+
+static void loadStackTop(Jit *jit) {
+  if (!jit->stackTopInRcx) {
+    emitLoad(&jit->as, RCX, RBX, offsetof(VM, stackTop));
+    jit->stackTopInRcx = true;
+  }
+}
+
+// Moves the stack top by `count` values.
+static void adjustStackTop(Jit *jit, int count) {
+  loadStackTop(jit);
+  emitAddImmediate(&jit->as, RCX, count * VALUE_SIZE);
+  emitStore(&jit->as, RBX, offsetof(VM, stackTop), RCX);
+}
+
+// Calls a helper with the VM as its first argument. The caller sets up any
+// other arguments first. The stack is 16-byte aligned here, since the prologue
+// pushed one register on top of the return address.
+static void emitCall(Jit *jit, uintptr_t function) {
+  emitMove(&jit->as, RDI, RBX);
+  emitLoadImmediate(&jit->as, RAX, function);
+  // call rax
+  EMIT(&jit->as, 0xff, 0xd0);
+  jit->stackTopInRcx = false;
+}
+
+// Bails out to the error exit if the helper just called returned false.
+static void emitErrorJumpIfFalse(Jit *jit) {
+  // test al, al
+  EMIT(&jit->as, 0x84, 0xc0);
+  emitErrorJump(jit, EQUAL);
+}
+
+// Points vm->ip past the instruction at `offset`, where the interpreter's would
+// be, so that a runtime error reports the line of its last byte. The fused
+// instructions' bytes can be from different lines.
+static void emitSetIp(Jit *jit, unsigned offset) {
+  unsigned end = offset + instructionLength(jit->chunk->code[offset]);
+  emitLoadImmediate(&jit->as, RAX, (uintptr_t)&jit->chunk->code[end]);
+  emitStore(&jit->as, RBX, offsetof(VM, ip), RAX);
+}
+
+static void emitRuntimeError(Jit *jit, unsigned offset, const char *message) {
+  emitSetIp(jit, offset);
+  emitLoadImmediate(&jit->as, RSI, (uintptr_t)message);
+  emitCall(jit, (uintptr_t)jitRuntimeError);
+  emitErrorJump(jit, ALWAYS);
+}
+
+static void emitCopyValue(Jit *jit, Register toBase, int32_t toDisp,
+                          Register fromBase, int32_t fromDisp) {
+  for (int32_t i = 0; i < VALUE_SIZE / 8; ++i) {
+    emitLoad(&jit->as, RDX, fromBase, fromDisp + 8 * i);
+    emitStore(&jit->as, toBase, toDisp + 8 * i, RDX);
+  }
+}
+
+static void pushFrom(Jit *jit, Register base, int32_t disp) {
+  loadStackTop(jit);
+  emitCopyValue(jit, RCX, 0, base, disp);
+  adjustStackTop(jit, 1);
+}
+
+static void pushValue(Jit *jit, Value value) {
+  loadStackTop(jit);
+  emitStoreValue(&jit->as, RCX, 0, value);
+  adjustStackTop(jit, 1);
+}
+
+static void pushConstant(Jit *jit, uint8_t index) {
+  // Objects can move, so they're loaded from the constant table each time
+  // rather than baked into the code. The table itself never moves once the
+  // chunk is compiled.
+  Value *constant = &jit->chunk->constants.values[index];
+  if (!isObj(*constant)) {
+    pushValue(jit, *constant);
+    return;
+  }
+  emitLoadImmediate(&jit->as, RAX, (uintptr_t)constant);
+  pushFrom(jit, RAX, 0);
+}
+
+static int32_t localDisp(uint8_t slot) {
+  return (int32_t)offsetof(VM, stack) + slot * VALUE_SIZE;
+}
+
+// The two operands of a binary instruction, relative to the stack top.
+#define LEFT (-2 * VALUE_SIZE)
+#define RIGHT (-VALUE_SIZE)
+
+// Does a number operation inline if both operands are numbers. If they aren't,
+// OP_ADD tries again out of line, since it might be a concatenation, and the
+// rest are errors.
+static void emitArithmetic(Jit *jit, unsigned offset, uint8_t opcode) {
+  Assembler *as = &jit->as;
+  loadStackTop(jit);
+  unsigned leftNotNumber = emitJumpUnlessNumber(as, RCX, LEFT);
+  unsigned rightNotNumber = emitJumpUnlessNumber(as, RCX, RIGHT);
+  emitSse(as, SD, MOVSD_LOAD, 0, RCX, LEFT + PAYLOAD);
+  emitSse(as, SD, opcode, 0, RCX, RIGHT + PAYLOAD);
+  // The left operand is already tagged as a number, so only the number itself
+  // needs to be replaced.
+  emitSse(as, SD, MOVSD_STORE, 0, RCX, LEFT + PAYLOAD);
+  adjustStackTop(jit, -1);
+  unsigned done = emitJump(as, ALWAYS);
+
+  patchJump(as, leftNotNumber);
+  patchJump(as, rightNotNumber);
+  if (opcode == ADDSD) {
+    emitSetIp(jit, offset);
+    emitCall(jit, (uintptr_t)jitAdd);
+    emitErrorJumpIfFalse(jit);
+    loadStackTop(jit);
+  } else {
+    emitRuntimeError(jit, offset, "Operands must be numbers.");
+  }
+  patchJump(as, done);
+  jit->stackTopInRcx = true;
+}
+
+// Compares `x` with `y` and stores the flag that `condition` tests as a bool.
+// ABOVE is false for NaN and BELOW_OR_EQUAL is true, which is what the negated
+// comparisons (see notBoolVal in vm.c) need.
+static void emitComparison(Jit *jit, unsigned offset, int32_t x, int32_t y,
+                           Condition condition) {
+  Assembler *as = &jit->as;
+  loadStackTop(jit);
+  unsigned leftNotNumber = emitJumpUnlessNumber(as, RCX, LEFT);
+  unsigned rightNotNumber = emitJumpUnlessNumber(as, RCX, RIGHT);
+  emitSse(as, SD, MOVSD_LOAD, 0, RCX, x + PAYLOAD);
+  emitSse(as, PD, UCOMISD, 0, RCX, y + PAYLOAD);
+  emitSetcc(as, condition);
+  emitStoreBool(as, RCX, LEFT);
+  adjustStackTop(jit, -1);
+  unsigned done = emitJump(as, ALWAYS);
+
+  patchJump(as, leftNotNumber);
+  patchJump(as, rightNotNumber);
+  emitRuntimeError(jit, offset, "Operands must be numbers.");
+  patchJump(as, done);
+  jit->stackTopInRcx = true;
+}
+
+static void emitNegate(Jit *jit, unsigned offset) {
+  Assembler *as = &jit->as;
+  loadStackTop(jit);
+  unsigned notNumber = emitJumpUnlessNumber(as, RCX, -VALUE_SIZE);
+  // Negating a double just flips its sign bit: xor [rcx - size], rax
+  emitLoadImmediate(as, RAX, (uint64_t)1 << 63);
+  EMIT(as, REX_W, 0x31);
+  emitModRM(as, RAX, RCX, -VALUE_SIZE + PAYLOAD);
+  unsigned done = emitJump(as, ALWAYS);
+
+  patchJump(as, notNumber);
+  emitRuntimeError(jit, offset, "Operand must be a number.");
+  patchJump(as, done);
+  jit->stackTopInRcx = true;
+}
+
+static void emitGetGlobal(Jit *jit, unsigned offset, uint16_t slot) {
+  Assembler *as = &jit->as;
+  loadStackTop(jit);
+  emitLoad(as, RAX, RBX, offsetof(VM, globalValues.values));
+  int32_t disp = slot * VALUE_SIZE;
+  // rax survives the check, since only the NaN-boxed one clobbers anything,
+  // and that's just rdx.
+  unsigned undefined = emitJumpIfUndefined(as, RAX, disp);
+  pushFrom(jit, RAX, disp);
+  unsigned done = emitJump(as, ALWAYS);
+
+  patchJump(as, undefined);
+  emitSetIp(jit, offset);
+  emitLoadImmediate32(as, RSI, slot);
+  emitCall(jit, (uintptr_t)jitUndefinedVariable);
+  emitErrorJump(jit, ALWAYS);
+  patchJump(as, done);
+  jit->stackTopInRcx = true;
+}
+
+static void emitCallWithSlot(Jit *jit, uintptr_t function, uint16_t slot) {
+  emitLoadImmediate32(&jit->as, RSI, slot);
+  emitCall(jit, function);
+}
+
+static void emitJumpIfFalse(Jit *jit, unsigned target) {
+  loadStackTop(jit);
+  unsigned jumps[2];
+  unsigned count = emitJumpIfFalsey(&jit->as, RCX, -VALUE_SIZE, jumps);
+  for (unsigned i = 0; i < count; ++i)
+    addJump(jit, jumps[i], target);
+}
+
+static void emitInstruction(Jit *jit, unsigned offset) {
+  uint8_t *ip = &jit->chunk->code[offset];
+  uint16_t slot = 0;
+  if (instructionLength(*ip) == 3)
+    slot = (uint16_t)((ip[1] << 8) | ip[2]);
+
+  // The quickened instructions do the same as their generic versions, and the
+  // templates already handle every operand type, so they share templates.
+  switch ((OpCode)*ip) {
+  case OP_CONSTANT:
+    pushConstant(jit, ip[1]);
+    break;
+  case OP_NIL:
+    pushValue(jit, nilVal());
+    break;
+  case OP_TRUE:
+    pushValue(jit, boolVal(true));
+    break;
+  case OP_FALSE:
+    pushValue(jit, boolVal(false));
+    break;
+  case OP_POP:
+    adjustStackTop(jit, -1);
+    break;
+  case OP_POP_N:
+    adjustStackTop(jit, -ip[1]);
+    break;
+  case OP_GET_LOCAL:
+    pushFrom(jit, RBX, localDisp(ip[1]));
+    break;
+  case OP_SET_LOCAL:
+    loadStackTop(jit);
+    emitCopyValue(jit, RBX, localDisp(ip[1]), RCX, -VALUE_SIZE);
+    break;
+  case OP_GET_GLOBAL:
+    emitGetGlobal(jit, offset, slot);
+    break;
+  case OP_DEFINE_GLOBAL:
+    emitCallWithSlot(jit, (uintptr_t)jitDefineGlobal, slot);
+    break;
+  case OP_SET_GLOBAL:
+    emitSetIp(jit, offset);
+    emitCallWithSlot(jit, (uintptr_t)jitSetGlobal, slot);
+    emitErrorJumpIfFalse(jit);
+    break;
+  case OP_EQUAL:
+    emitCall(jit, (uintptr_t)jitEqual);
+    break;
+  case OP_NOT_EQUAL:
+    emitCall(jit, (uintptr_t)jitNotEqual);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitComparison(jit, offset, LEFT, RIGHT, ABOVE);
+    break;
+  case OP_GREATER_EQUAL:
+    emitComparison(jit, offset, RIGHT, LEFT, BELOW_OR_EQUAL);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitComparison(jit, offset, RIGHT, LEFT, ABOVE);
+    break;
+  case OP_LESS_EQUAL:
+    emitComparison(jit, offset, LEFT, RIGHT, BELOW_OR_EQUAL);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    emitArithmetic(jit, offset, ADDSD);
+    break;
+  case OP_ADD_LOCALS:
+    pushFrom(jit, RBX, localDisp(ip[1]));
+    pushFrom(jit, RBX, localDisp(ip[2]));
+    emitArithmetic(jit, offset, ADDSD);
+    break;
+  case OP_CONSTANT_ADD:
+    pushConstant(jit, ip[1]);
+    emitArithmetic(jit, offset, ADDSD);
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    emitArithmetic(jit, offset, SUBSD);
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    emitArithmetic(jit, offset, MULSD);
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emitArithmetic(jit, offset, DIVSD);
+    break;
+  case OP_NOT:
+    emitCall(jit, (uintptr_t)jitNot);
+    break;
+  case OP_NEGATE:
+    emitNegate(jit, offset);
+    break;
+  case OP_PRINT:
+    emitCall(jit, (uintptr_t)jitPrint);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    addJump(jit, emitJump(&jit->as, ALWAYS), jumpTarget(jit->chunk, offset));
+    break;
+  case OP_JUMP_IF_FALSE:
+    emitJumpIfFalse(jit, jumpTarget(jit->chunk, offset));
+    break;
+  case OP_RETURN:
+    emitReturn(jit, INTERPRET_OK);
+    break;
+  }
+}
+
+bool compileJit(VM *vm, Chunk *chunk) {
+  if (chunk->jitCode != NULL)
+    return true;
+
+  Jit jit = {.chunk = chunk};
+  initAssembler(&jit.as, vm);
+  jit.nativeOffsets = ALLOCATE(vm, MEM_JIT, unsigned, chunk->count);
+  jit.isJumpTarget = ALLOCATE(vm, MEM_JIT, bool, chunk->count);
+  memset(jit.isJumpTarget, 0, chunk->count);
+  for (unsigned offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    OpCode op = chunk->code[offset];
+    if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+      jit.isJumpTarget[jumpTarget(chunk, offset)] = true;
+  }
+
+  // push rbx; mov rbx, rdi
+  emitByte(&jit.as, 0x53);
+  emitMove(&jit.as, RBX, RDI);
+
+  for (unsigned offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    // Control can arrive here from elsewhere, with anything in rcx.
+    if (jit.isJumpTarget[offset])
+      jit.stackTopInRcx = false;
+    jit.nativeOffsets[offset] = jit.as.count;
+    emitInstruction(&jit, offset);
+  }
+
+  for (unsigned i = 0; i < jit.jumpCount; ++i) {
+    JumpPatch *jump = &jit.jumps[i];
+    patchJumpTo(&jit.as, jump->at, jit.nativeOffsets[jump->target]);
+  }
+
+  // Every chunk ends in OP_RETURN, so nothing falls through to here.
+  for (unsigned i = 0; i < jit.errorJumpCount; ++i)
+    patchJump(&jit.as, jit.errorJumps[i]);
+  emitReturn(&jit, INTERPRET_RUNTIME_ERROR);
+
+  void *code = mapExecutable(&jit.as);
+  if (code != NULL) {
+    chunk->jitCode = code;
+    chunk->jitCodeSize = jit.as.count;
+  }
+
+  FREE_ARRAY(vm, MEM_JIT, unsigned, jit.nativeOffsets, chunk->count);
+  FREE_ARRAY(vm, MEM_JIT, bool, jit.isJumpTarget, chunk->count);
+  FREE_ARRAY(vm, MEM_JIT, JumpPatch, jit.jumps, jit.jumpCapacity);
+  FREE_ARRAY(vm, MEM_JIT, unsigned, jit.errorJumps, jit.errorJumpCapacity);
+  freeAssembler(&jit.as);
+  return code != NULL;
+}
+
+#else
+
+bool compileJit(VM *vm, Chunk *chunk) {
+  (void)vm;
+  (void)chunk;
+  return false;
+}
+
+#endif
+
+InterpretResult runJit(VM *vm, Chunk *chunk) {
+  InterpretResult (*code)(VM *) = (InterpretResult(*)(VM *))chunk->jitCode;
+  return code(vm);
+}
+
+void freeJitCode(Chunk *chunk) {
+  unmapExecutable(chunk->jitCode, chunk->jitCodeSize);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// A baseline JIT for x86-64. It translates a chunk into machine code by
+// stitching together a fixed template for each instruction, which does away
+// with decoding and dispatching instructions at run time. Values stay on
+// vm->stack, just as in the interpreter. Number arithmetic and comparisons,
+// constants, locals and reading globals are done inline, and everything else
+// (strings, writing globals, errors) calls back into the C helpers below.
+//
+// The compiled code is cached in the chunk, so a script is only compiled the
+// first time it's run with the JIT enabled (vm->jit). vm->ip is only kept up to
+// date before calls that can report an error, so the sampler attributes JIT
+// samples to the last such instruction.
+
+// Compiles `chunk` if it hasn't been compiled yet. Returns false if it can't
+// be, e.g. because this isn't x86-64, in which case the caller should fall back
+// to interpreting it.
+bool compileJit(VM *vm, Chunk *chunk);
+// Runs `chunk`, which must have been compiled, with vm->chunk already set.
+InterpretResult runJit(VM *vm, Chunk *chunk);
+void freeJitCode(Chunk *chunk);
+
+// The instructions the compiled code calls out to. vm.c defines these, since
+// they need its internals. The ones that return bool return false after
+// reporting a runtime error, which needs vm->ip to point into the instruction.
+bool jitAdd(VM *vm);
+void jitEqual(VM *vm);
+void jitNotEqual(VM *vm);
+void jitNot(VM *vm);
+void jitPrint(VM *vm);
+void jitDefineGlobal(VM *vm, unsigned slot);
+bool jitSetGlobal(VM *vm, unsigned slot);
+void jitUndefinedVariable(VM *vm, unsigned slot);
+void jitRuntimeError(VM *vm, const char *message);
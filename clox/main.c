@@ -3,12 +3,19 @@
 #include <string.h>
 #include <sysexits.h>
 
+#include "batch.h"
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "emitc.h"
+#include "memstats.h"
+#include "profile.h"
+#include "sampler.h"
+#include "script.h"
+#include "trace.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM *vm) {
   char line[1024];
   while (true) {
     printf("> ");
@@ -18,62 +25,149 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(vm, line);
   }
 }
 
-static char *readFile(const char *path) {
-  FILE *file = fopen(path, "r");
-  if (!file) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(EX_IOERR);
+static void usage() {
+  fputs("Usage: clox [--jit | --trace-jit] [--trace=file | --profile[=file]] "
+        "[--sample=file] [--mem-stats] [--cache-dir=dir] [path]\n"
+        "       clox --batch=manifest [--jobs=n] [--jit] [--cache-dir=dir]\n"
+        "       clox --emit-c=file path\n",
+        stderr);
+  exit(EX_USAGE);
+}
+
+int main(int argc, const char *argv[]) {
+  const char *path = NULL;
+  const char *tracePath = NULL;
+  const char *profilePath = NULL;
+  const char *samplePath = NULL;
+  const char *manifestPath = NULL;
+  const char *jobs = NULL;
+  const char *emitCPath = NULL;
+  const char *cacheDir = NULL;
+  bool jit = false;
+  bool traceJit = false;
+  bool memStats = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--trace=", strlen("--trace=")) == 0)
+      tracePath = argv[i] + strlen("--trace=");
+    else if (strcmp(argv[i], "--profile") == 0)
+      profilePath = "clox-profile.json";
+    else if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0)
+      profilePath = argv[i] + strlen("--profile=");
+    else if (strncmp(argv[i], "--sample=", strlen("--sample=")) == 0)
+      samplePath = argv[i] + strlen("--sample=");
+    else if (strncmp(argv[i], "--batch=", strlen("--batch=")) == 0)
+      manifestPath = argv[i] + strlen("--batch=");
+    else if (strncmp(argv[i], "--jobs=", strlen("--jobs=")) == 0)
+      jobs = argv[i] + strlen("--jobs=");
+    else if (strncmp(argv[i], "--emit-c=", strlen("--emit-c=")) == 0)
+      emitCPath = argv[i] + strlen("--emit-c=");
+    else if (strncmp(argv[i], "--cache-dir=", strlen("--cache-dir=")) == 0)
+      cacheDir = argv[i] + strlen("--cache-dir=");
+    else if (strcmp(argv[i], "--jit") == 0)
+      jit = true;
+    else if (strcmp(argv[i], "--trace-jit") == 0)
+      traceJit = true;
+    else if (strcmp(argv[i], "--mem-stats") == 0)
+      memStats = true;
+    else if (argv[i][0] == '-' || path != NULL)
+      usage();
+    else
+      path = argv[i];
   }
+  if ((tracePath != NULL && profilePath != NULL) || (jit && traceJit))
+    usage();
 
-  fseek(file, 0, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+  // Batch mode runs scripts on several threads at once, which the profilers
+  // and tracer aren't set up for.
+  if (manifestPath != NULL) {
+    if (path != NULL || tracePath != NULL || profilePath != NULL ||
+        samplePath != NULL || traceJit || emitCPath != NULL || memStats)
+      usage();
 
-  char *buffer = malloc(fileSize + 1);
-  if (!buffer) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(EX_IOERR);
+    unsigned threadCount = 0;
+    if (jobs != NULL) {
+      char *end;
+      unsigned long parsed = strtoul(jobs, &end, 10);
+      if (*jobs == '\0' || *end != '\0' || parsed > UINT16_MAX)
+        usage();
+      threadCount = (unsigned)parsed;
+    }
+    return runBatch(manifestPath, threadCount, jit, cacheDir);
   }
+  if (jobs != NULL)
+    usage();
+
+  VM vm;
+  initVM(&vm);
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(EX_IOERR);
+  // Compiling to C doesn't run anything, so none of the other options apply.
+  if (emitCPath != NULL) {
+    if (path == NULL || tracePath != NULL || profilePath != NULL ||
+        samplePath != NULL || jit || traceJit || memStats || cacheDir != NULL)
+      usage();
+    int exitCode = emitCFile(&vm, path, emitCPath);
+    freeVM(&vm);
+    return exitCode;
   }
+  vm.jit = jit;
+  vm.traceJit = traceJit;
 
-  buffer[bytesRead] = '\0';
+  Tracer tracer;
+  if (tracePath != NULL) {
+    initTracer(&tracer, TRACE_CAPACITY);
+    vm.tracer = &tracer;
+  }
 
-  fclose(file);
-  return buffer;
-}
+  // Big enough that it shouldn't live on the stack.
+  static Profiler profiler;
+  if (profilePath != NULL) {
+    initProfiler(&profiler);
+    vm.profiler = &profiler;
+  }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+  if (samplePath != NULL && !startSampler(&vm, SAMPLE_INTERVAL_US)) {
+    fputs("Could not start the sampling profiler.\n", stderr);
+    samplePath = NULL;
+  }
 
-  if (result == INTERPRET_COMPILE_ERROR)
-    exit(EX_DATAERR);
-  if (result == INTERPRET_RUNTIME_ERROR)
-    exit(EX_SOFTWARE);
-}
+  int exitCode = 0;
+  if (path == NULL)
+    repl(&vm);
+  else
+    exitCode = runFile(&vm, path, cacheDir);
 
-int main(int argc, const char *argv[]) {
-  initVM();
-
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
-  } else {
-    fputs("Usage: clox[path]\n", stderr);
-    exit(EX_USAGE);
+  // Write these out even if the script failed, since that's when a trace is
+  // most useful.
+  if (tracePath != NULL) {
+    if (!dumpTrace(&tracer, tracePath))
+      fprintf(stderr, "Could not write trace to \"%s\".\n", tracePath);
+    vm.tracer = NULL;
+    freeTracer(&tracer);
+  }
+
+  if (profilePath != NULL) {
+    printProfile(&profiler, stderr);
+    if (!writeProfileJson(&profiler, profilePath))
+      fprintf(stderr, "Could not write profile to \"%s\".\n", profilePath);
+    vm.profiler = NULL;
   }
 
-  freeVM();
+  if (samplePath != NULL) {
+    stopSampler();
+    if (!writeSamples(samplePath, path != NULL ? path : "repl"))
+      fprintf(stderr, "Could not write samples to \"%s\".\n", samplePath);
+  }
+
+  if (memStats)
+    printMemoryStats(&vm.memory, stderr);
+
+  if (exitCode != 0)
+    exit(exitCode);
+
+  freeVM(&vm);
   return 0;
 }
@@ -1,12 +1,60 @@
 #include "memory.h"
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "compiler.h"
 #include "object.h"
+#include "slab.h"
+#include "table.h"
 #include "vm.h"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  (void)oldSize; // Why do we even have that lever?
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+#define NURSERY_ALIGNMENT _Alignof(max_align_t)
+
+static size_t alignToNursery(size_t size) {
+  return (size + NURSERY_ALIGNMENT - 1) & ~(NURSERY_ALIGNMENT - 1);
+}
+
+void initHeap(VM *vm) {
+  vm->objects = NULL;
+  vm->bytesAllocated = 0;
+  vm->nextGC = GC_INITIAL_HEAP_SIZE;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+
+  initMemoryStats(&vm->memory);
+  initSlabs(&vm->slabs);
+
+  vm->nurseryStart = malloc(NURSERY_SIZE);
+  if (vm->nurseryStart == NULL)
+    exit(1);
+  vm->nurseryTop = vm->nurseryStart;
+  vm->nurseryEnd = vm->nurseryStart + NURSERY_SIZE;
+
+  vm->rememberedGlobals = NULL;
+  vm->rememberedGlobalCount = 0;
+  vm->rememberedGlobalCapacity = 0;
+  vm->isGlobalRemembered = NULL;
+  vm->isGlobalRememberedCapacity = 0;
+  vm->rememberedKeys = NULL;
+  vm->rememberedKeyCount = 0;
+  vm->rememberedKeyCapacity = 0;
+  vm->youngRopes = NULL;
+  vm->youngRopeCount = 0;
+  vm->youngRopeCapacity = 0;
+  vm->youngRopeBytes = 0;
+}
+
+void *reallocate(VM *vm, MemoryCategory category, void *pointer,
+                 size_t oldSize, size_t newSize) {
+  vm->bytesAllocated += newSize - oldSize;
+  countFree(&vm->memory, category, oldSize);
+  countAllocation(&vm->memory, category, newSize);
 
   if (newSize == 0) {
     free(pointer);
@@ -20,19 +68,433 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-static void freeObject(Obj *obj) {
+static size_t objectSize(Obj *obj) {
   switch (obj->type) {
   case OBJ_STRING:
-    reallocate(obj, sizeof(ObjString) + ((ObjString *)obj)->length + 1, 0);
+    return sizeof(ObjString) + ((ObjString *)obj)->length + 1;
+  case OBJ_ROPE:
+    return sizeof(ObjRope);
+  }
+}
+
+static MemoryCategory objectCategory(ObjType type) {
+  return (MemoryCategory)(MEM_FIRST_OBJECT + type);
+}
+
+// Objects in the old generation come from the slabs instead of going through
+// reallocate, since their sizes never change. They count towards the heap
+// size all the same.
+static Obj *allocateOld(VM *vm, size_t size) {
+  vm->bytesAllocated += slabSize(size);
+  Obj *obj = slabAllocate(&vm->slabs, size);
+  if (obj == NULL)
+    exit(1);
+  return obj;
+}
+
+static void collectYoung(VM *vm);
+
+static void rememberYoungRope(VM *vm, Obj *rope) {
+  if (vm->youngRopeCapacity < vm->youngRopeCount + 1) {
+    unsigned oldCapacity = vm->youngRopeCapacity;
+    vm->youngRopeCapacity = GROW_CAPACITY(oldCapacity);
+    vm->youngRopes = GROW_ARRAY(vm, MEM_GC, Obj *, vm->youngRopes, oldCapacity,
+                                vm->youngRopeCapacity);
+  }
+  vm->youngRopes[vm->youngRopeCount++] = rope;
+}
+
+static void freeRopeChars(VM *vm, ObjRope *rope) {
+  if (rope->chars != NULL)
+    FREE_ARRAY(vm, MEM_ROPE_CHARS, char, rope->chars, rope->length + 1);
+}
+
+// Young objects die without being freed one by one, so this frees what the
+// young ropes that weren't copied out of the nursery own.
+static void freeYoungRopes(VM *vm) {
+  for (unsigned i = 0; i < vm->youngRopeCount; ++i) {
+    Obj *rope = vm->youngRopes[i];
+    if (rope->next == NULL)
+      freeRopeChars(vm, (ObjRope *)rope);
+  }
+  vm->youngRopeCount = 0;
+  vm->youngRopeBytes = 0;
+}
+
+Obj *allocateObject(VM *vm, size_t size, ObjType type) {
+  bool belongsInNursery = size <= NURSERY_MAX_OBJECT_SIZE;
+  size_t nurserySize = alignToNursery(size);
+
+#ifdef DEBUG_STRESS_GC
+  collectGarbage(vm);
+#else
+  // Young ropes' buffers take up room in the nursery as far as this is
+  // concerned, since they can only be freed by a minor collection.
+  if (belongsInNursery && (size_t)(vm->nurseryEnd - vm->nurseryTop) <
+                              nurserySize + vm->youngRopeBytes)
+    collectYoung(vm);
+  if (vm->bytesAllocated > vm->nextGC)
+    collectGarbage(vm);
+#endif
+
+  countAllocation(&vm->memory, objectCategory(type), size);
+
+  Obj *obj;
+  if (belongsInNursery) {
+    vm->memory.youngBytes[objectCategory(type)] += size;
+    obj = (Obj *)vm->nurseryTop;
+    vm->nurseryTop += nurserySize;
+    // Young objects aren't on the objects list; a non-null next pointer means
+    // the object has been copied out of the nursery, and points to the copy.
+    obj->next = NULL;
+    if (type == OBJ_ROPE)
+      rememberYoungRope(vm, obj);
+  } else {
+    obj = allocateOld(vm, size);
+    obj->next = vm->objects;
+    vm->objects = obj;
+  }
+
+  obj->type = type;
+  obj->isMarked = false;
+  return obj;
+}
+
+static void freeObject(VM *vm, Obj *obj) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)obj, obj->type);
+#endif
+
+  if (obj->type == OBJ_ROPE)
+    freeRopeChars(vm, (ObjRope *)obj);
+
+  size_t size = objectSize(obj);
+  vm->bytesAllocated -= slabSize(size);
+  countFree(&vm->memory, objectCategory(obj->type), size);
+  slabFree(&vm->slabs, obj, size);
+}
+
+void freeNewestObject(VM *vm, Obj *obj) {
+  if (isYoung(vm, obj)) {
+    size_t size = objectSize(obj);
+    uint8_t *end = (uint8_t *)obj + alignToNursery(size);
+    if (end == vm->nurseryTop) {
+      vm->nurseryTop = (uint8_t *)obj;
+      vm->memory.youngBytes[objectCategory(obj->type)] -= size;
+      countFree(&vm->memory, objectCategory(obj->type), size);
+    }
+    return;
+  }
+
+  if (vm->objects == obj) {
+    vm->objects = obj->next;
+    freeObject(vm, obj);
+  }
+}
+
+// Both kinds of collection use the gray stack as their worklist. It's
+// deliberately allocated outside of reallocate, so that it doesn't count
+// towards the heap size.
+static void pushGray(VM *vm, Obj *obj) {
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+    if (vm->grayStack == NULL)
+      exit(1);
+  }
+
+  vm->grayStack[vm->grayCount++] = obj;
+}
+
+// Minor collections.
+
+// Copies a young object out to the old generation, unless that's already been
+// done, and returns the copy. Old objects are returned as-is.
+static Obj *forwardObject(VM *vm, Obj *obj) {
+  if (obj == NULL || !isYoung(vm, obj))
+    return obj;
+  if (obj->next != NULL)
+    return obj->next;
+
+  size_t size = objectSize(obj);
+  Obj *promoted = allocateOld(vm, size);
+  memcpy(promoted, obj, size);
+  vm->memory.youngBytes[objectCategory(obj->type)] -= size;
+  promoted->next = vm->objects;
+  vm->objects = promoted;
+  obj->next = promoted;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p ", (void *)obj, (void *)promoted);
+  printValue(vm, stdout, objVal(promoted));
+  putchar('\n');
+#endif
+
+  // Its references might point into the nursery too.
+  pushGray(vm, promoted);
+  return promoted;
+}
+
+static void forwardValue(VM *vm, Value *value) {
+  if (isYoungValue(vm, *value))
+    *value = objVal(forwardObject(vm, asObj(*value)));
+}
+
+void forwardArray(VM *vm, ValueArray *array) {
+  for (unsigned i = 0; i < array->count; ++i)
+    forwardValue(vm, &array->values[i]);
+}
+
+static void forwardReferences(VM *vm, Obj *obj) {
+  switch (obj->type) {
+  case OBJ_STRING:
+    break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)obj;
+    rope->left = forwardObject(vm, rope->left);
+    rope->right = forwardObject(vm, rope->right);
     break;
   }
+  }
 }
 
-void freeObjects() {
-  Obj *obj = vm.objects;
+void rememberGlobal(VM *vm, unsigned slot) {
+  if (slot >= vm->isGlobalRememberedCapacity) {
+    unsigned oldCapacity = vm->isGlobalRememberedCapacity;
+    vm->isGlobalRememberedCapacity = vm->globalValues.capacity;
+    vm->isGlobalRemembered =
+        GROW_ARRAY(vm, MEM_GC, bool, vm->isGlobalRemembered, oldCapacity,
+                   vm->isGlobalRememberedCapacity);
+    memset(vm->isGlobalRemembered + oldCapacity, false,
+           vm->isGlobalRememberedCapacity - oldCapacity);
+  }
+
+  if (vm->isGlobalRemembered[slot])
+    return;
+  vm->isGlobalRemembered[slot] = true;
+
+  if (vm->rememberedGlobalCapacity < vm->rememberedGlobalCount + 1) {
+    unsigned oldCapacity = vm->rememberedGlobalCapacity;
+    vm->rememberedGlobalCapacity = GROW_CAPACITY(oldCapacity);
+    vm->rememberedGlobals =
+        GROW_ARRAY(vm, MEM_GC, unsigned, vm->rememberedGlobals, oldCapacity,
+                   vm->rememberedGlobalCapacity);
+  }
+
+  vm->rememberedGlobals[vm->rememberedGlobalCount++] = slot;
+}
+
+void rememberTableKey(VM *vm, Table *table, ObjString *key) {
+  if (vm->rememberedKeyCapacity < vm->rememberedKeyCount + 1) {
+    unsigned oldCapacity = vm->rememberedKeyCapacity;
+    vm->rememberedKeyCapacity = GROW_CAPACITY(oldCapacity);
+    vm->rememberedKeys =
+        GROW_ARRAY(vm, MEM_GC, RememberedKey, vm->rememberedKeys, oldCapacity,
+                   vm->rememberedKeyCapacity);
+  }
+
+  vm->rememberedKeys[vm->rememberedKeyCount++] = (RememberedKey){table, key};
+}
+
+static void collectYoung(VM *vm) {
+#ifdef DEBUG_LOG_GC
+  puts("-- minor gc begin");
+#endif
+
+  for (Value *slot = vm->stack; slot < vm->stackTop; ++slot)
+    forwardValue(vm, slot);
+
+  if (vm->chunk != NULL)
+    forwardArray(vm, &vm->chunk->constants);
+  forwardCompilerRoots(vm);
+  for (Script *script = vm->scripts; script != NULL; script = script->next)
+    forwardArray(vm, &script->chunk.constants);
+
+  for (unsigned i = 0; i < vm->rememberedGlobalCount; ++i) {
+    unsigned slot = vm->rememberedGlobals[i];
+    forwardValue(vm, &vm->globalValues.values[slot]);
+    forwardValue(vm, &vm->globalNames.values[slot]);
+    vm->isGlobalRemembered[slot] = false;
+  }
+
+  // Entries keep their slot when their key is swapped for its copy, since the
+  // hash stays the same. The young key is still intact at this point, so we
+  // can use it to look the entry up.
+  for (unsigned i = 0; i < vm->rememberedKeyCount; ++i) {
+    RememberedKey *remembered = &vm->rememberedKeys[i];
+    if (remembered->table == &vm->strings)
+      continue;
+
+    Entry *entry = tableEntry(remembered->table, remembered->key);
+    if (entry == NULL)
+      continue;
+    entry->key = (ObjString *)forwardObject(vm, (Obj *)entry->key);
+    forwardValue(vm, &entry->value);
+  }
+
+  while (vm->grayCount > 0)
+    forwardReferences(vm, vm->grayStack[--vm->grayCount]);
+
+  // Now that everything reachable has been copied out, the intern table can
+  // drop the young strings that weren't.
+  for (unsigned i = 0; i < vm->rememberedKeyCount; ++i) {
+    RememberedKey *remembered = &vm->rememberedKeys[i];
+    if (remembered->table != &vm->strings)
+      continue;
+
+    Entry *entry = tableEntry(remembered->table, remembered->key);
+    if (entry == NULL)
+      continue;
+    if (entry->key->obj.next != NULL)
+      entry->key = (ObjString *)entry->key->obj.next;
+    else
+      tableDelete(remembered->table, remembered->key);
+  }
+
+  vm->rememberedGlobalCount = 0;
+  vm->rememberedKeyCount = 0;
+  freeYoungRopes(vm);
+  vm->nurseryTop = vm->nurseryStart;
+
+  // Whatever wasn't promoted is garbage.
+  for (unsigned i = MEM_FIRST_OBJECT; i < MEM_CATEGORY_COUNT; ++i) {
+    countFree(&vm->memory, (MemoryCategory)i, vm->memory.youngBytes[i]);
+    vm->memory.youngBytes[i] = 0;
+  }
+
+#ifdef DEBUG_LOG_GC
+  puts("-- minor gc end");
+#endif
+}
+
+// Full collections. These always start with a minor collection, so the
+// nursery is empty by the time we mark.
+
+void markObject(VM *vm, Obj *obj) {
+  if (obj == NULL || obj->isMarked)
+    return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)obj);
+  printValue(vm, stdout, objVal(obj));
+  putchar('\n');
+#endif
+
+  obj->isMarked = true;
+  pushGray(vm, obj);
+}
+
+void markValue(VM *vm, Value value) {
+  if (isObj(value))
+    markObject(vm, asObj(value));
+}
+
+void markArray(VM *vm, ValueArray *array) {
+  for (unsigned i = 0; i < array->count; ++i)
+    markValue(vm, array->values[i]);
+}
+
+static void blackenObject(VM *vm, Obj *obj) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void *)obj);
+  printValue(vm, stdout, objVal(obj));
+  putchar('\n');
+#endif
+
+  switch (obj->type) {
+  case OBJ_STRING:
+    // Strings don't refer to anything.
+    break;
+  case OBJ_ROPE:
+    markObject(vm, ((ObjRope *)obj)->left);
+    markObject(vm, ((ObjRope *)obj)->right);
+    break;
+  }
+}
+
+static void markRoots(VM *vm) {
+  for (Value *slot = vm->stack; slot < vm->stackTop; ++slot)
+    markValue(vm, *slot);
+
+  markTable(vm, &vm->globalSlots);
+  markArray(vm, &vm->globalValues);
+  markArray(vm, &vm->globalNames);
+
+  if (vm->chunk != NULL)
+    markArray(vm, &vm->chunk->constants);
+  markCompilerRoots(vm);
+  for (Script *script = vm->scripts; script != NULL; script = script->next)
+    markArray(vm, &script->chunk.constants);
+}
+
+static void traceReferences(VM *vm) {
+  while (vm->grayCount > 0)
+    blackenObject(vm, vm->grayStack[--vm->grayCount]);
+}
+
+static void sweep(VM *vm) {
+  Obj *previous = NULL;
+  Obj *obj = vm->objects;
+  while (obj != NULL) {
+    if (obj->isMarked) {
+      obj->isMarked = false;
+      previous = obj;
+      obj = obj->next;
+      continue;
+    }
+
+    Obj *unreached = obj;
+    obj = obj->next;
+    if (previous != NULL)
+      previous->next = obj;
+    else
+      vm->objects = obj;
+
+    freeObject(vm, unreached);
+  }
+}
+
+void collectGarbage(VM *vm) {
+  collectYoung(vm);
+
+#ifdef DEBUG_LOG_GC
+  puts("-- gc begin");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  markRoots(vm);
+  traceReferences(vm);
+  tableRemoveWhite(&vm->strings);
+  sweep(vm);
+
+  vm->nextGC = (size_t)(vm->bytesAllocated * GC_HEAP_GROW_FACTOR);
+  if (vm->nextGC < GC_INITIAL_HEAP_SIZE)
+    vm->nextGC = GC_INITIAL_HEAP_SIZE;
+
+#ifdef DEBUG_LOG_GC
+  puts("-- gc end");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+void freeObjects(VM *vm) {
+  Obj *obj = vm->objects;
   while (obj != NULL) {
     Obj *next = obj->next;
-    freeObject(obj);
+    freeObject(vm, obj);
     obj = next;
   }
+  freeYoungRopes(vm);
+
+  freeSlabs(&vm->slabs);
+  free(vm->grayStack);
+  free(vm->nurseryStart);
+  FREE_ARRAY(vm, MEM_GC, unsigned, vm->rememberedGlobals,
+             vm->rememberedGlobalCapacity);
+  FREE_ARRAY(vm, MEM_GC, bool, vm->isGlobalRemembered,
+             vm->isGlobalRememberedCapacity);
+  FREE_ARRAY(vm, MEM_GC, RememberedKey, vm->rememberedKeys,
+             vm->rememberedKeyCapacity);
+  FREE_ARRAY(vm, MEM_GC, Obj *, vm->youngRopes, vm->youngRopeCapacity);
 }
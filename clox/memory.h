@@ -1,21 +1,84 @@
 #pragma once
 
 #include "common.h"
+#include "memstats.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
 
-#define ALLOCATE(type, count)                                                  \
-  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+// The heap may grow by this factor between collections. Bigger means fewer
+// collections at the cost of more garbage lying around.
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define GC_INITIAL_HEAP_SIZE (1024 * 1024)
+
+// New objects are bump-allocated in a fixed-size nursery, and only the ones
+// still reachable when it fills up get copied out to the old generation.
+// Anything too big to be worth copying goes straight to the old generation.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+#define NURSERY_MAX_OBJECT_SIZE (NURSERY_SIZE / 16)
+
+#define ALLOCATE(vm, category, type, count)                                    \
+  (type *)reallocate(vm, category, NULL, 0, sizeof(type) * (count))
+
+#define FREE(vm, category, type, pointer)                                      \
+  reallocate(vm, category, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
-  (type *)reallocate(pointer, sizeof(type) * (oldCount),                       \
+#define GROW_ARRAY(vm, category, type, pointer, oldCount, newCount)            \
+  (type *)reallocate(vm, category, pointer, sizeof(type) * (oldCount),         \
                      sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount)                                    \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, category, type, pointer, oldCount)                      \
+  reallocate(vm, category, pointer, sizeof(type) * (oldCount), 0)
+
+// Collections only ever happen in allocateObject, never in reallocate. Since a
+// minor collection moves objects, anything the caller of allocateObject refers
+// to must be reachable from the roots, and the caller must re-read it from
+// there afterwards.
+// `category` says what the memory is for, for vm->memory (see memstats.h).
+void *reallocate(VM *vm, MemoryCategory category, void *pointer,
+                 size_t oldSize, size_t newSize);
+Obj *allocateObject(VM *vm, size_t size, ObjType type);
+void freeNewestObject(VM *vm, Obj *obj);
+
+void markObject(VM *vm, Obj *obj);
+void markValue(VM *vm, Value value);
+void markArray(VM *vm, ValueArray *array);
+void forwardArray(VM *vm, ValueArray *array);
+void collectGarbage(VM *vm);
+
+// Write barriers. Minor collections don't scan all of the globals or the
+// tables, so anything that stores a young object in one of those must call the
+// corresponding barrier. (The stack and the constant pools are always scanned,
+// so storing into them doesn't need one.)
+void rememberGlobal(VM *vm, unsigned slot);
+void rememberTableKey(VM *vm, Table *table, ObjString *key);
+
+void initHeap(VM *vm);
+void freeObjects(VM *vm);
+
+// See value.h for an explanation.
+#define ALWAYS_INLINE __attribute__((__always_inline__)) inline
+
+ALWAYS_INLINE bool isYoung(VM *vm, Obj *obj) {
+  return (uint8_t *)obj >= vm->nurseryStart && (uint8_t *)obj < vm->nurseryEnd;
+}
+
+ALWAYS_INLINE bool isYoungValue(VM *vm, Value value) {
+  return isObj(value) && isYoung(vm, asObj(value));
+}
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+ALWAYS_INLINE void globalWriteBarrier(VM *vm, unsigned slot, Value value) {
+  if (isYoungValue(vm, value))
+    rememberGlobal(vm, slot);
+}
 
-void freeObjects(void);
+#undef ALWAYS_INLINE
@@ -0,0 +1,54 @@
+#include "memstats.h"
+
+#include <string.h>
+
+void initMemoryStats(MemoryStats *stats) { memset(stats, 0, sizeof(*stats)); }
+
+const char *memoryCategoryName(MemoryCategory category) {
+  switch (category) {
+  case MEM_CODE:
+    return "code";
+  case MEM_LINES:
+    return "lines";
+  case MEM_CONSTANTS:
+    return "constants";
+  case MEM_GLOBALS:
+    return "globals";
+  case MEM_TABLES:
+    return "tables";
+  case MEM_SCRIPTS:
+    return "scripts";
+  case MEM_GC:
+    return "gc";
+  case MEM_COMPILER:
+    return "compiler";
+  case MEM_JIT:
+    return "jit";
+  case MEM_ROPE_CHARS:
+    return "rope chars";
+  case MEM_OBJ_STRING:
+    return "string objects";
+  case MEM_OBJ_ROPE:
+    return "rope objects";
+  case MEM_CATEGORY_COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+static void printCounter(const char *name, const MemoryCounter *counter,
+                         FILE *file) {
+  fprintf(file, "%-16s %14zu %14zu %14zu %14zu\n", name, counter->allocated,
+          counter->freed, counter->live, counter->peak);
+}
+
+void printMemoryStats(const MemoryStats *stats, FILE *file) {
+  fprintf(file, "%-16s %14s %14s %14s %14s\n", "memory", "allocated", "freed",
+          "live", "peak");
+  for (unsigned i = 0; i < MEM_CATEGORY_COUNT; ++i) {
+    const MemoryCounter *counter = &stats->categories[i];
+    if (counter->allocated > 0)
+      printCounter(memoryCategoryName((MemoryCategory)i), counter, file);
+  }
+  printCounter("total", &stats->total, file);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Memory accounting. Everything a VM allocates on the heap, including the
+// buffers of flattened ropes (see object.h), goes through reallocate or
+// allocateObject, which tell its MemoryStats what for, so vm->memory always
+// knows how many bytes each kind of allocation has taken, given back and
+// holds right now, and the most it ever held at once. `clox --mem-stats`
+// prints them when the script finishes.
+//
+// Objects are counted at their own size, not what the nursery or the slabs
+// round them up to, and promoting one out of the nursery doesn't count as
+// allocating it again. Resizing an array counts as freeing the old one and
+// allocating the new one. The gray stack and the nursery itself are
+// bookkeeping for the collector, and the JIT's machine code is mapped straight
+// from the OS (see x64.h), so none of those are counted.
+
+typedef enum {
+  MEM_CODE,
+  MEM_LINES,
+  MEM_CONSTANTS,
+  MEM_GLOBALS,
+  MEM_TABLES,
+  MEM_SCRIPTS,
+  MEM_GC,
+  MEM_COMPILER,
+  MEM_JIT,
+  MEM_ROPE_CHARS,
+  // One per ObjType, in the same order.
+  MEM_OBJ_STRING,
+  MEM_OBJ_ROPE,
+  MEM_CATEGORY_COUNT,
+} MemoryCategory;
+
+#define MEM_FIRST_OBJECT MEM_OBJ_STRING
+
+typedef struct {
+  size_t allocated;
+  size_t freed;
+  size_t live;
+  size_t peak;
+} MemoryCounter;
+
+typedef struct {
+  MemoryCounter categories[MEM_CATEGORY_COUNT];
+  MemoryCounter total;
+  // Bytes of young objects allocated since the last minor collection and not
+  // promoted yet, by category. Whatever's left when the nursery is emptied
+  // was garbage.
+  size_t youngBytes[MEM_CATEGORY_COUNT];
+} MemoryStats;
+
+void initMemoryStats(MemoryStats *stats);
+const char *memoryCategoryName(MemoryCategory category);
+// Prints a table of every category that was ever used, and the totals.
+void printMemoryStats(const MemoryStats *stats, FILE *file);
+
+// See value.h for an explanation.
+#define ALWAYS_INLINE __attribute__((__always_inline__)) inline
+
+ALWAYS_INLINE void addToCounter(MemoryCounter *counter, size_t size) {
+  counter->allocated += size;
+  counter->live += size;
+  if (counter->live > counter->peak)
+    counter->peak = counter->live;
+}
+
+ALWAYS_INLINE void subtractFromCounter(MemoryCounter *counter, size_t size) {
+  counter->freed += size;
+  counter->live -= size;
+}
+
+ALWAYS_INLINE void countAllocation(MemoryStats *stats, MemoryCategory category,
+                                   size_t size) {
+  addToCounter(&stats->categories[category], size);
+  addToCounter(&stats->total, size);
+}
+
+ALWAYS_INLINE void countFree(MemoryStats *stats, MemoryCategory category,
+                             size_t size) {
+  subtractFromCounter(&stats->categories[category], size);
+  subtractFromCounter(&stats->total, size);
+}
+
+#undef ALWAYS_INLINE
@@ -1,81 +1,174 @@
 #include "object.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *obj = reallocate(NULL, 0, size);
-  obj->type = type;
-  obj->next = vm.objects;
-  vm.objects = obj;
-  return obj;
-}
-
 #define ALLOCATE_OBJ(type, objType) (type *)allocateObj(sizeof(type), objType)
 
-static ObjString *allocateString(unsigned length) {
-  ObjString *string =
-      (ObjString *)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+static ObjString *allocateString(VM *vm, unsigned length) {
+  ObjString *string = (ObjString *)allocateObject(
+      vm, sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
   return string;
 }
 
+// Every flat string is interned as soon as it's made, so it needs its hash
+// right away. Ropes are never hashed.
 static uint32_t hashString(const char *key, unsigned length) {
-  uint32_t hash = 2166136261u;
-  for (unsigned i = 0; i < length; ++i) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+  return (uint32_t)hashBytes(key, length);
 }
 
-ObjString *copyString(const char *chars, unsigned length) {
+ObjString *copyString(VM *vm, const char *chars, unsigned length) {
   uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL)
     return interned;
 
-  ObjString *string = allocateString(length);
+  ObjString *string = allocateString(vm, length);
   memcpy(string->chars, chars, length);
   string->chars[length] = '\0';
   string->hash = hash;
-  tableSet(&vm.strings, string, nilVal());
+
+  tableSet(vm, &vm->strings, string, nilVal());
   return string;
 }
 
-ObjString *concatenateStrings(ObjString *a, ObjString *b) {
+ObjString *concatenateStrings(VM *vm, ObjString *a, ObjString *b) {
   unsigned length = a->length + b->length;
   assert(length >= a->length && "String length overflow");
-  ObjString *string = allocateString(length);
+
+  // Allocating can move the operands out of the nursery, so hold onto them
+  // somewhere the collector will update.
+  push(vm, OBJ_VAL(a));
+  push(vm, OBJ_VAL(b));
+  ObjString *string = allocateString(vm, length);
+  b = asString(pop(vm));
+  a = asString(pop(vm));
+
   memcpy(string->chars, a->chars, a->length);
   memcpy(string->chars + a->length, b->chars, b->length);
   string->chars[length] = '\0';
   string->hash = hashString(string->chars, length);
 
   ObjString *interned =
-      tableFindString(&vm.strings, string->chars, length, string->hash);
+      tableFindString(&vm->strings, string->chars, length, string->hash);
   if (interned != NULL) {
-    // TODO: Should we just let the garbage collector do this instead later?
-    assert(vm.objects == (Obj *)string);
-    vm.objects = vm.objects->next;
-    reallocate(string, sizeof(ObjString) + length + 1, 0);
-
+    // Nothing else can refer to the copy yet, so there's no point in leaving it
+    // for the garbage collector.
+    freeNewestObject(vm, (Obj *)string);
     return interned;
   }
 
-  tableSet(&vm.strings, string, nilVal());
+  tableSet(vm, &vm->strings, string, nilVal());
   return string;
 }
 
-void printObject(Value value) {
+Value addStrings(VM *vm, Value a, Value b) {
+  unsigned aLength = stringLength(asObj(a));
+  unsigned bLength = stringLength(asObj(b));
+  unsigned length = aLength + bLength;
+  assert(length >= aLength && "String length overflow");
+
+  // Strings are immutable, so there's no need for a new one.
+  if (aLength == 0)
+    return b;
+  if (bLength == 0)
+    return a;
+  // Neither can be a rope if the result is this short.
+  if (length < ROPE_MIN_LENGTH)
+    return OBJ_VAL(concatenateStrings(vm, asString(a), asString(b)));
+
+  push(vm, a);
+  push(vm, b);
+  ObjRope *rope = (ObjRope *)allocateObject(vm, sizeof(ObjRope), OBJ_ROPE);
+  rope->right = asObj(pop(vm));
+  rope->left = asObj(pop(vm));
+  rope->length = length;
+  rope->chars = NULL;
+  return objVal((Obj *)rope);
+}
+
+// Copies the characters of `string` to `buffer`. This recurses into the shorter
+// half of each rope and loops on the longer one, so it never goes more than
+// log2(length) calls deep, however lopsided the rope is.
+static void writeChars(Obj *string, char *buffer) {
+  while (string->type == OBJ_ROPE) {
+    ObjRope *rope = (ObjRope *)string;
+    if (rope->chars != NULL) {
+      memcpy(buffer, rope->chars, rope->length);
+      return;
+    }
+    unsigned leftLength = stringLength(rope->left);
+    if (leftLength < rope->length - leftLength) {
+      writeChars(rope->left, buffer);
+      buffer += leftLength;
+      string = rope->right;
+    } else {
+      writeChars(rope->right, buffer + leftLength);
+      string = rope->left;
+    }
+  }
+
+  ObjString *flat = (ObjString *)string;
+  memcpy(buffer, flat->chars, flat->length);
+}
+
+// Returns the characters of `string`, flattening it first if it's a rope that
+// hasn't been flattened yet. That allocates, but never collects.
+static const char *stringChars(VM *vm, Obj *string) {
+  if (string->type == OBJ_STRING)
+    return ((ObjString *)string)->chars;
+
+  ObjRope *rope = (ObjRope *)string;
+  if (rope->chars == NULL) {
+    char *chars = ALLOCATE(vm, MEM_ROPE_CHARS, char, rope->length + 1);
+    writeChars(string, chars);
+    chars[rope->length] = '\0';
+    rope->chars = chars;
+    rope->left = NULL;
+    rope->right = NULL;
+    if (isYoung(vm, string))
+      vm->youngRopeBytes += rope->length + 1;
+  }
+  return rope->chars;
+}
+
+static bool isStringObject(Obj *obj) {
+  return obj->type == OBJ_STRING || obj->type == OBJ_ROPE;
+}
+
+bool objectsEqual(VM *vm, Obj *a, Obj *b) {
+  if (a == b)
+    return true;
+  if (!isStringObject(a) || !isStringObject(b))
+    return false;
+
+  unsigned length = stringLength(a);
+  if (length != stringLength(b))
+    return false;
+  // Flat strings are interned.
+  if (a->type == OBJ_STRING && b->type == OBJ_STRING)
+    return false;
+
+  return memcmp(stringChars(vm, a), stringChars(vm, b), length) == 0;
+}
+
+void printObject(VM *vm, FILE *file, Value value) {
   switch (objType(value)) {
   case OBJ_STRING:
-    printf("%s", asCString(value));
+    fputs(asCString(value), file);
+    break;
+  case OBJ_ROPE: {
+    Obj *rope = asObj(value);
+    fwrite(stringChars(vm, rope), 1, stringLength(rope), file);
     break;
   }
+  }
 }
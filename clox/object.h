@@ -5,13 +5,17 @@
 
 typedef enum {
   OBJ_STRING,
+  OBJ_ROPE,
 } ObjType;
 
 typedef struct Obj {
   ObjType type;
+  bool isMarked;
   struct Obj *next;
 } Obj;
 
+// Flat strings are interned, so two of them are equal exactly when they're the
+// same object.
 struct ObjString {
   Obj obj;
   unsigned length;
@@ -19,10 +23,44 @@ struct ObjString {
   char chars[];
 };
 
-ObjString *copyString(const char *chars, unsigned length);
-ObjString *concatenateStrings(ObjString *a, ObjString *b);
+// Concatenating two strings at runtime doesn't copy them when the result would
+// be long: it makes a rope, which just points at both halves, so building up a
+// string one piece at a time takes linear time instead of quadratic. Ropes
+// aren't interned or hashed. The first time one is compared or printed, it's
+// flattened: its characters are copied into a buffer of its own, which it keeps
+// in place of its halves. Using it again then costs no more than using a flat
+// string, and the halves can be collected. The buffer is allocated with
+// reallocate, so it counts towards the next collection, and a young rope's
+// buffer counts towards filling up the nursery. The compiler only ever makes
+// flat strings, so constants and global names are never ropes.
+//
+// Both kinds are Lox strings: isString is true for either, and the length is
+// in the same place. asString is only for flat strings.
+typedef struct {
+  Obj obj;
+  unsigned length;
+  // The halves, until the rope is flattened.
+  Obj *left;
+  Obj *right;
+  // The characters, NUL-terminated, once it's flattened.
+  char *chars;
+} ObjRope;
+
+// Concatenations shorter than this are made flat.
+#define ROPE_MIN_LENGTH 32
+
+ObjString *copyString(VM *vm, const char *chars, unsigned length);
+// Concatenates two flat strings into another flat string. Allocating the result
+// can trigger a collection, which may move the operands, so callers must not
+// use their own pointers to them afterwards.
+ObjString *concatenateStrings(VM *vm, ObjString *a, ObjString *b);
+// Lox's + on two strings, either of which may be a rope. Moves the operands
+// like concatenateStrings.
+Value addStrings(VM *vm, Value a, Value b);
+// Lox's == on two objects.
+bool objectsEqual(VM *vm, Obj *a, Obj *b);
 
-void printObject(Value value);
+void printObject(VM *vm, FILE *file, Value value);
 
 // See value.h for an explanation.
 #define ALWAYS_INLINE __attribute__((__always_inline__)) inline
@@ -34,16 +72,25 @@ ALWAYS_INLINE bool isObjType(Value value, ObjType type) {
 }
 
 ALWAYS_INLINE bool isString(Value value) {
+  return isObjType(value, OBJ_STRING) || isObjType(value, OBJ_ROPE);
+}
+
+ALWAYS_INLINE bool isFlatString(Value value) {
   return isObjType(value, OBJ_STRING);
 }
 
+ALWAYS_INLINE unsigned stringLength(Obj *string) {
+  return string->type == OBJ_STRING ? ((ObjString *)string)->length
+                                    : ((ObjRope *)string)->length;
+}
+
 ALWAYS_INLINE ObjString *asString(Value value) {
-  assert(isString(value) && "Called asString on non-string");
+  assert(isFlatString(value) && "Called asString on non-flat string");
   return (ObjString *)asObj(value);
 }
 
 ALWAYS_INLINE char *asCString(Value value) {
-  assert(isString(value) && "Called asCString on non-string");
+  assert(isFlatString(value) && "Called asCString on non-flat string");
   return ((ObjString *)asObj(value))->chars;
 }
 
@@ -0,0 +1,160 @@
+#include "optimizer.h"
+
+#include <string.h>
+
+#include "memory.h"
+
+// A fused instruction can't swallow a jump target, since there'd be nothing
+// left to jump to, so fusing stops at targets. Compacting the code moves the
+// targets, so every jump gets its distance fixed up at the end.
+
+// Whether the instruction at `offset` is `op` and can be fused onto the
+// instruction before it.
+static bool isOp(Chunk *chunk, const bool *isJumpTarget, unsigned offset,
+                 OpCode op) {
+  return offset < chunk->count && chunk->code[offset] == op &&
+         !isJumpTarget[offset];
+}
+
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP;
+}
+
+// Instructions are only ever shrunk, so the write cursor never overtakes the
+// read cursor and we can compact the code in place. Callers must read
+// everything they need from the original instructions before emitting, since
+// the first few bytes may get overwritten. The line table is rebuilt on the
+// side, since runs can't be edited in place.
+static void emit(VM *vm, Chunk *chunk, LineTable *lines, unsigned *offset,
+                 uint8_t byte, unsigned line) {
+  chunk->code[*offset] = byte;
+  writeLine(vm, lines, *offset, line);
+  ++*offset;
+}
+
+// Returns the fused opcode for `op` followed by OP_NOT, or OP_NOT if there's no
+// such superinstruction. Note that OP_GREATER_EQUAL must still be evaluated as
+// !(a < b) rather than a >= b, since the two differ for NaN.
+static OpCode negatedComparison(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return OP_NOT_EQUAL;
+  case OP_LESS:
+    return OP_GREATER_EQUAL;
+  case OP_GREATER:
+    return OP_LESS_EQUAL;
+  default:
+    return OP_NOT;
+  }
+}
+
+void optimizeChunk(VM *vm, Chunk *chunk) {
+  uint8_t *code = chunk->code;
+  LineTable lines;
+  initLineTable(&lines);
+  unsigned read = 0;
+  unsigned write = 0;
+
+  // Indexed by original offset (with room for the end of the code, which
+  // jumps can't target but is handy to map anyway).
+  unsigned originalCount = chunk->count;
+  bool *isJumpTarget = ALLOCATE(vm, MEM_COMPILER, bool, originalCount + 1);
+  unsigned *newOffsets =
+      ALLOCATE(vm, MEM_COMPILER, unsigned, originalCount + 1);
+  // Indexed by new offset: where each jump pointed originally.
+  unsigned *originalTargets =
+      ALLOCATE(vm, MEM_COMPILER, unsigned, originalCount);
+  memset(isJumpTarget, 0, originalCount + 1);
+  for (unsigned offset = 0; offset < originalCount;
+       offset += instructionLength(code[offset])) {
+    if (isJump(code[offset]) && offset + 3 <= originalCount)
+      isJumpTarget[jumpTarget(chunk, offset)] = true;
+  }
+
+  // Runtime errors report the line of the byte just before the instruction
+  // pointer, i.e. the last byte of the failing instruction. Each fused
+  // instruction therefore gives its last byte the line of the original
+  // instruction that can fail, and its opcode byte the line of the first
+  // original instruction (which is what the disassembler shows).
+  while (read < chunk->count) {
+    uint8_t instruction = code[read];
+    newOffsets[read] = write;
+
+    if (instruction == OP_GET_LOCAL &&
+        isOp(chunk, isJumpTarget, read + 2, OP_GET_LOCAL) &&
+        isOp(chunk, isJumpTarget, read + 4, OP_ADD)) {
+      uint8_t a = code[read + 1];
+      uint8_t b = code[read + 3];
+      unsigned line = getLine(chunk, read);
+      unsigned addLine = getLine(chunk, read + 4);
+      emit(vm, chunk, &lines, &write, OP_ADD_LOCALS, line);
+      emit(vm, chunk, &lines, &write, a, line);
+      emit(vm, chunk, &lines, &write, b, addLine);
+      read += 5;
+      continue;
+    }
+
+    if (instruction == OP_CONSTANT &&
+        isOp(chunk, isJumpTarget, read + 2, OP_ADD)) {
+      uint8_t constant = code[read + 1];
+      unsigned line = getLine(chunk, read);
+      unsigned addLine = getLine(chunk, read + 2);
+      emit(vm, chunk, &lines, &write, OP_CONSTANT_ADD, line);
+      emit(vm, chunk, &lines, &write, constant, addLine);
+      read += 3;
+      continue;
+    }
+
+    OpCode negated = negatedComparison(instruction);
+    if (negated != OP_NOT &&
+        isOp(chunk, isJumpTarget, read + 1, OP_NOT)) {
+      emit(vm, chunk, &lines, &write, negated, getLine(chunk, read));
+      read += 2;
+      continue;
+    }
+
+    if (instruction == OP_POP &&
+        isOp(chunk, isJumpTarget, read + 1, OP_POP)) {
+      unsigned count = 1;
+      while (count < UINT8_MAX &&
+             isOp(chunk, isJumpTarget, read + count, OP_POP))
+        ++count;
+      unsigned line = getLine(chunk, read);
+      unsigned lastLine = getLine(chunk, read + count - 1);
+      emit(vm, chunk, &lines, &write, OP_POP_N, line);
+      emit(vm, chunk, &lines, &write, (uint8_t)count, lastLine);
+      read += count;
+      continue;
+    }
+
+    if (isJump(instruction) && read + 3 <= chunk->count)
+      originalTargets[write] = jumpTarget(chunk, read);
+
+    unsigned length = instructionLength(instruction);
+    for (unsigned i = 0; i < length && read < chunk->count; ++i, ++read)
+      emit(vm, chunk, &lines, &write, code[read], getLine(chunk, read));
+  }
+  newOffsets[originalCount] = write;
+
+  chunk->count = write;
+  freeLineTable(vm, &chunk->lines);
+  chunk->lines = lines;
+
+  // Code only ever shrinks, so the new distances still fit.
+  for (unsigned offset = 0; offset < chunk->count;
+       offset += instructionLength(code[offset])) {
+    if (!isJump(code[offset]))
+      continue;
+
+    unsigned target = newOffsets[originalTargets[offset]];
+    unsigned distance =
+        code[offset] == OP_LOOP ? offset + 3 - target : target - offset - 3;
+    code[offset + 1] = (distance >> 8) & 0xff;
+    code[offset + 2] = distance & 0xff;
+  }
+
+  FREE_ARRAY(vm, MEM_COMPILER, bool, isJumpTarget, originalCount + 1);
+  FREE_ARRAY(vm, MEM_COMPILER, unsigned, newOffsets, originalCount + 1);
+  FREE_ARRAY(vm, MEM_COMPILER, unsigned, originalTargets, originalCount);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "chunk.h"
+
+// Rewrites a finished chunk in place, fusing common instruction sequences into
+// superinstructions (e.g. OP_LESS OP_NOT becomes OP_GREATER_EQUAL). The line
+// table is kept in sync, so runtime errors still point at the same lines.
+void optimizeChunk(VM *vm, Chunk *chunk);
@@ -0,0 +1,145 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+// How many of the most common pairs to report.
+#define REPORTED_PAIRS 20
+
+void initProfiler(Profiler *profiler) {
+  memset(profiler, 0, sizeof(*profiler));
+  profiler->previous = NO_OPCODE;
+}
+
+void beginProfiledRun(Profiler *profiler) { profiler->previous = NO_OPCODE; }
+
+void endProfiledRun(Profiler *profiler) {
+  // Charge the last instruction, which nothing was dispatched after.
+  if (profiler->previous != NO_OPCODE)
+    profiler->time[profiler->previous] +=
+        readProfileClock() - profiler->previousStart;
+  profiler->previous = NO_OPCODE;
+}
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} Pair;
+
+static Profiler *sortedProfiler;
+
+static int compareOpcodesByTime(const void *a, const void *b) {
+  uint64_t timeA = sortedProfiler->time[*(const uint8_t *)a];
+  uint64_t timeB = sortedProfiler->time[*(const uint8_t *)b];
+  return (timeA < timeB) - (timeA > timeB);
+}
+
+static int comparePairsByCount(const void *a, const void *b) {
+  uint64_t countA = ((const Pair *)a)->count;
+  uint64_t countB = ((const Pair *)b)->count;
+  return (countA < countB) - (countA > countB);
+}
+
+// Returns the opcodes that ran, slowest in total first.
+static unsigned sortOpcodes(Profiler *profiler, uint8_t *opcodes) {
+  unsigned count = 0;
+  for (unsigned op = 0; op < OPCODE_COUNT; ++op) {
+    if (profiler->counts[op] > 0)
+      opcodes[count++] = (uint8_t)op;
+  }
+
+  sortedProfiler = profiler;
+  qsort(opcodes, count, sizeof(uint8_t), compareOpcodesByTime);
+  return count;
+}
+
+// Returns the pairs that ran, most common first.
+static unsigned sortPairs(Profiler *profiler, Pair *pairs) {
+  unsigned count = 0;
+  for (unsigned first = 0; first < OPCODE_COUNT; ++first) {
+    for (unsigned second = 0; second < OPCODE_COUNT; ++second) {
+      uint64_t pairCount = profiler->pairCounts[first][second];
+      if (pairCount > 0)
+        pairs[count++] = (Pair){(uint8_t)first, (uint8_t)second, pairCount};
+    }
+  }
+
+  qsort(pairs, count, sizeof(Pair), comparePairsByCount);
+  return count;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0 : 100.0 * (double)part / (double)whole;
+}
+
+void printProfile(Profiler *profiler, FILE *file) {
+  uint64_t totalCount = 0;
+  uint64_t totalTime = 0;
+  for (unsigned op = 0; op < OPCODE_COUNT; ++op) {
+    totalCount += profiler->counts[op];
+    totalTime += profiler->time[op];
+  }
+
+  uint8_t opcodes[OPCODE_COUNT];
+  unsigned opcodeCount = sortOpcodes(profiler, opcodes);
+  fprintf(file, "%-18s %14s %6s %16s %6s %10s\n", "opcode", "count", "%",
+          PROFILE_CLOCK_UNIT, "%", "per op");
+  for (unsigned i = 0; i < opcodeCount; ++i) {
+    uint8_t op = opcodes[i];
+    uint64_t count = profiler->counts[op];
+    uint64_t time = profiler->time[op];
+    fprintf(file, "%-18s %14llu %5.1f%% %16llu %5.1f%% %10.1f\n",
+            opcodeName(op), (unsigned long long)count,
+            percent(count, totalCount), (unsigned long long)time,
+            percent(time, totalTime), (double)time / (double)count);
+  }
+  fprintf(file, "%-18s %14llu %6s %16llu\n", "total",
+          (unsigned long long)totalCount, "", (unsigned long long)totalTime);
+
+  static Pair pairs[OPCODE_COUNT * OPCODE_COUNT];
+  unsigned pairCount = sortPairs(profiler, pairs);
+  if (pairCount == 0)
+    return;
+
+  fprintf(file, "\n%-37s %14s %6s\n", "pair", "count", "%");
+  for (unsigned i = 0; i < pairCount && i < REPORTED_PAIRS; ++i) {
+    fprintf(file, "%-18s %-18s %14llu %5.1f%%\n", opcodeName(pairs[i].first),
+            opcodeName(pairs[i].second), (unsigned long long)pairs[i].count,
+            percent(pairs[i].count, totalCount));
+  }
+}
+
+bool writeProfileJson(Profiler *profiler, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+
+  uint8_t opcodes[OPCODE_COUNT];
+  unsigned opcodeCount = sortOpcodes(profiler, opcodes);
+  fprintf(file, "{\n  \"clock\": \"%s\",\n  \"opcodes\": [", PROFILE_CLOCK_UNIT);
+  for (unsigned i = 0; i < opcodeCount; ++i) {
+    uint8_t op = opcodes[i];
+    fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"time\": %llu}",
+            i == 0 ? "" : ",", opcodeName(op),
+            (unsigned long long)profiler->counts[op],
+            (unsigned long long)profiler->time[op]);
+  }
+  fputs("\n  ],\n  \"pairs\": [", file);
+
+  // Every pair, unlike the report.
+  static Pair pairs[OPCODE_COUNT * OPCODE_COUNT];
+  unsigned pairCount = sortPairs(profiler, pairs);
+  for (unsigned i = 0; i < pairCount; ++i) {
+    fprintf(file,
+            "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+            i == 0 ? "" : ",", opcodeName(pairs[i].first),
+            opcodeName(pairs[i].second), (unsigned long long)pairs[i].count);
+  }
+  fputs("\n  ]\n}\n", file);
+
+  bool failed = ferror(file) != 0;
+  return fclose(file) == 0 && !failed;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Per-opcode profiling. When a profiler is installed (vm->profiler), the VM
+// runs a copy of its dispatch loop that counts how often each opcode and each
+// pair of consecutive opcodes executes, and how much time each opcode takes.
+// The pair counts show which sequences are worth fusing into
+// superinstructions.
+//
+// An instruction's time is measured from its dispatch to the next one's, so it
+// includes the dispatch overhead and a share of the clock reads. A quickened
+// instruction that deoptimizes is counted once, as itself, even though it runs
+// the generic instruction's handler.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK_UNIT "cycles"
+#else
+#include <time.h>
+#define PROFILE_CLOCK_UNIT "ns"
+#endif
+
+// Stands in for the previous opcode at the start of a run.
+#define NO_OPCODE UINT8_MAX
+
+typedef struct {
+  uint64_t counts[OPCODE_COUNT];
+  uint64_t time[OPCODE_COUNT];
+  uint64_t pairCounts[OPCODE_COUNT][OPCODE_COUNT];
+  uint8_t previous;
+  uint64_t previousStart;
+} Profiler;
+
+void initProfiler(Profiler *profiler);
+void beginProfiledRun(Profiler *profiler);
+void endProfiledRun(Profiler *profiler);
+// Prints a report, hottest opcodes first, to `file`.
+void printProfile(Profiler *profiler, FILE *file);
+// Returns false if the file couldn't be written.
+bool writeProfileJson(Profiler *profiler, const char *path);
+
+// See value.h for an explanation.
+#define ALWAYS_INLINE __attribute__((__always_inline__)) inline
+
+ALWAYS_INLINE uint64_t readProfileClock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+ALWAYS_INLINE void profileInstruction(Profiler *profiler, uint8_t opcode) {
+  uint64_t now = readProfileClock();
+  if (profiler->previous != NO_OPCODE) {
+    profiler->time[profiler->previous] += now - profiler->previousStart;
+    ++profiler->pairCounts[profiler->previous][opcode];
+  }
+  ++profiler->counts[opcode];
+  profiler->previous = opcode;
+  profiler->previousStart = now;
+}
+
+#undef ALWAYS_INLINE
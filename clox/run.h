@@ -0,0 +1,346 @@
+// The dispatch loop. vm.c includes this several times to stamp out a plain copy
+// and instrumented copies of it, so the includer must define RUN as the name of
+// the function, BEFORE_INSTRUCTION() as what to do before each instruction and
+// AFTER_LOOP() as what to do once OP_LOOP has jumped back.
+
+static InterpretResult RUN(VM *vm) {
+#define READ_BYTE() (*vm->ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_SHORT() (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
+#define GLOBAL_NAME(slot) asString(vm->globalNames.values[slot])
+
+#define BINARY_OP_WITH_ERROR(valueType, op, typeErrorMessage)                  \
+  do {                                                                         \
+    if (!isNumber(peek(vm, 0)) || !isNumber(peek(vm, 1))) {                    \
+      runtimeError(vm, typeErrorMessage);                                      \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    double b = asNumber(pop(vm));                                              \
+    double a = asNumber(pop(vm));                                              \
+    push(vm, valueType(a op b));                                               \
+  } while (false)
+
+#define BINARY_OP(valueType, op)                                               \
+  BINARY_OP_WITH_ERROR(valueType, op, "Operands must be numbers.")
+
+  // Quickening: the generic arithmetic instructions rewrite themselves in place
+  // to a variant specialized for the operand types they just saw. A specialized
+  // instruction only has to check that its guess still holds. If it doesn't, it
+  // turns back into the generic instruction and jumps straight to its handler,
+  // which will then pick a new specialization. Jumping rather than dispatching
+  // again keeps BEFORE_INSTRUCTION() to once per instruction executed. All of
+  // these are single-byte instructions, so the opcode is always at vm->ip[-1].
+#define QUICKEN(op) (vm->ip[-1] = (op))
+
+#define QUICKENING_BINARY_OP(valueType, op, quickenedOp)                       \
+  do {                                                                         \
+    BINARY_OP(valueType, op);                                                  \
+    QUICKEN(quickenedOp);                                                      \
+  } while (false)
+
+#define DEOPTIMIZE_UNLESS(condition, genericOp)                                \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      QUICKEN(genericOp);                                                      \
+      goto GENERIC_##genericOp;                                                \
+    }                                                                          \
+  } while (false)
+
+#define NUMBER_BINARY_OP(valueType, op)                                        \
+  do {                                                                         \
+    double b = asNumber(pop(vm));                                              \
+    double a = asNumber(pop(vm));                                              \
+    push(vm, valueType(a op b));                                               \
+  } while (false)
+
+  // With computed gotos, every instruction ends with its own indirect jump to
+  // the next handler, which gives the branch predictor one history per opcode
+  // instead of a single shared one for the whole switch. CASE and DISPATCH let
+  // the handlers below be written once for both dispatch modes.
+#ifdef COMPUTED_GOTO
+#define X(op) [OP_##op] = &&CASE_OP_##op,
+  static void *const dispatchTable[] = {OPCODES};
+#undef X
+
+#define CASE(op) CASE_##op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    BEFORE_INSTRUCTION();                                                      \
+    goto *dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+
+  DISPATCH();
+#else
+#define CASE(op) case op:
+#define DISPATCH() continue
+
+  while (true) {
+    BEFORE_INSTRUCTION();
+    switch (READ_BYTE()) {
+#endif
+
+  // The generic instructions that quickened ones deoptimize to also get a
+  // label of their own to jump to.
+#define GENERIC_CASE(op) CASE(op) GENERIC_##op:
+
+    CASE(OP_CONSTANT) {
+      Value constant = READ_CONSTANT();
+      push(vm, constant);
+      DISPATCH();
+    }
+
+    CASE(OP_NIL) {
+      push(vm, nilVal());
+      DISPATCH();
+    }
+
+    CASE(OP_TRUE) {
+      push(vm, boolVal(true));
+      DISPATCH();
+    }
+
+    CASE(OP_FALSE) {
+      push(vm, boolVal(false));
+      DISPATCH();
+    }
+
+    CASE(OP_POP) {
+      pop(vm);
+      DISPATCH();
+    }
+
+    CASE(OP_POP_N) {
+      vm->stackTop -= READ_BYTE();
+      DISPATCH();
+    }
+
+    CASE(OP_GET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      push(vm, vm->stack[slot]);
+      DISPATCH();
+    }
+
+    CASE(OP_SET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      vm->stack[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+
+    CASE(OP_GET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      if (isUndefined(value)) {
+        runtimeError(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(vm, value);
+      DISPATCH();
+    }
+
+    CASE(OP_DEFINE_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = pop(vm);
+      globalWriteBarrier(vm, slot, value);
+      vm->globalValues.values[slot] = value;
+      DISPATCH();
+    }
+
+    CASE(OP_SET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      if (isUndefined(vm->globalValues.values[slot])) {
+        runtimeError(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      globalWriteBarrier(vm, slot, peek(vm, 0));
+      vm->globalValues.values[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+
+    CASE(OP_EQUAL) {
+      Value a = pop(vm);
+      Value b = pop(vm);
+      push(vm, boolVal(valuesEqual(vm, a, b)));
+      DISPATCH();
+    }
+
+    CASE(OP_NOT_EQUAL) {
+      Value a = pop(vm);
+      Value b = pop(vm);
+      push(vm, boolVal(!valuesEqual(vm, a, b)));
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_GREATER) {
+      QUICKENING_BINARY_OP(boolVal, >, OP_GREATER_NUM);
+      DISPATCH();
+    }
+
+    CASE(OP_GREATER_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_GREATER);
+      NUMBER_BINARY_OP(boolVal, >);
+      DISPATCH();
+    }
+
+    CASE(OP_GREATER_EQUAL) {
+      BINARY_OP(notBoolVal, <);
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_LESS) {
+      QUICKENING_BINARY_OP(boolVal, <, OP_LESS_NUM);
+      DISPATCH();
+    }
+
+    CASE(OP_LESS_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_LESS);
+      NUMBER_BINARY_OP(boolVal, <);
+      DISPATCH();
+    }
+
+    CASE(OP_LESS_EQUAL) {
+      BINARY_OP(notBoolVal, >);
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_ADD) {
+      if (isString(peek(vm, 0)) && isString(peek(vm, 1))) {
+        QUICKEN(OP_ADD_STR);
+        concatenate(vm);
+      } else {
+        BINARY_OP_WITH_ERROR(numberVal, +,
+                             "Operands must be two numbers or two strings.");
+        QUICKEN(OP_ADD_NUM);
+      }
+      DISPATCH();
+    }
+
+    CASE(OP_ADD_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_ADD);
+      NUMBER_BINARY_OP(numberVal, +);
+      DISPATCH();
+    }
+
+    CASE(OP_ADD_STR) {
+      DEOPTIMIZE_UNLESS(isString(peek(vm, 0)) && isString(peek(vm, 1)), OP_ADD);
+      concatenate(vm);
+      DISPATCH();
+    }
+
+    CASE(OP_ADD_LOCALS) {
+      Value a = vm->stack[READ_BYTE()];
+      Value b = vm->stack[READ_BYTE()];
+      if (!add(vm, a, b))
+        return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
+
+    CASE(OP_CONSTANT_ADD) {
+      Value b = READ_CONSTANT();
+      if (!add(vm, pop(vm), b))
+        return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_SUBTRACT) {
+      QUICKENING_BINARY_OP(numberVal, -, OP_SUBTRACT_NUM);
+      DISPATCH();
+    }
+
+    CASE(OP_SUBTRACT_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_SUBTRACT);
+      NUMBER_BINARY_OP(numberVal, -);
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_MULTIPLY) {
+      QUICKENING_BINARY_OP(numberVal, *, OP_MULTIPLY_NUM);
+      DISPATCH();
+    }
+
+    CASE(OP_MULTIPLY_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_MULTIPLY);
+      NUMBER_BINARY_OP(numberVal, *);
+      DISPATCH();
+    }
+
+    GENERIC_CASE(OP_DIVIDE) {
+      QUICKENING_BINARY_OP(numberVal, /, OP_DIVIDE_NUM);
+      DISPATCH();
+    }
+
+    CASE(OP_DIVIDE_NUM) {
+      DEOPTIMIZE_UNLESS(isNumber(peek(vm, 0)) && isNumber(peek(vm, 1)),
+                        OP_DIVIDE);
+      NUMBER_BINARY_OP(numberVal, /);
+      DISPATCH();
+    }
+
+    CASE(OP_NOT) {
+      push(vm, boolVal(isFalsey(pop(vm))));
+      DISPATCH();
+    }
+
+    CASE(OP_NEGATE) {
+      if (!isNumber(peek(vm, 0))) {
+        runtimeError(vm, "Operand must be a number.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(vm, numberVal(-asNumber(pop(vm))));
+      DISPATCH();
+    }
+
+    CASE(OP_PRINT) {
+      printValue(vm, vm->out, pop(vm));
+      fputc('\n', vm->out);
+      DISPATCH();
+    }
+
+    CASE(OP_JUMP) {
+      uint16_t offset = READ_SHORT();
+      vm->ip += offset;
+      DISPATCH();
+    }
+
+    CASE(OP_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(vm, 0)))
+        vm->ip += offset;
+      DISPATCH();
+    }
+
+    CASE(OP_LOOP) {
+      uint16_t offset = READ_SHORT();
+      vm->ip -= offset;
+      AFTER_LOOP();
+      DISPATCH();
+    }
+
+    CASE(OP_RETURN) {
+      // Exit interpreter.
+      return INTERPRET_OK;
+    }
+
+#ifndef COMPUTED_GOTO
+    }
+  }
+#endif
+
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef GLOBAL_NAME
+#undef BINARY_OP_WITH_ERROR
+#undef BINARY_OP
+#undef QUICKEN
+#undef QUICKENING_BINARY_OP
+#undef DEOPTIMIZE_UNLESS
+#undef NUMBER_BINARY_OP
+#undef CASE
+#undef GENERIC_CASE
+#undef DISPATCH
+}
@@ -0,0 +1,144 @@
+// sigaction and friends are POSIX, not C.
+#define _POSIX_C_SOURCE 200809L
+
+#include "sampler.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+// Samples are counted per line in a fixed-size open-addressing table, since the
+// signal handler can't allocate. Lines past the table's capacity are dropped.
+#define SAMPLE_TABLE_SIZE 4096
+
+// A key of 0 marks an empty slot; lines start at 1.
+static _Atomic uint32_t sampleLines[SAMPLE_TABLE_SIZE];
+static _Atomic uint64_t sampleCounts[SAMPLE_TABLE_SIZE];
+static _Atomic uint64_t outsideSamples;
+static _Atomic uint64_t droppedSamples;
+
+static struct sigaction previousAction;
+
+// Timers and signal handlers are per process, so only one VM can be sampled at
+// a time.
+static VM *sampledVM;
+
+static void countSample(unsigned line) {
+  unsigned index = (line * 2654435761u) & (SAMPLE_TABLE_SIZE - 1);
+  for (unsigned probes = 0; probes < SAMPLE_TABLE_SIZE; ++probes) {
+    uint32_t existing = atomic_load_explicit(&sampleLines[index],
+                                             memory_order_relaxed);
+    if (existing == 0) {
+      uint32_t empty = 0;
+      if (atomic_compare_exchange_strong_explicit(&sampleLines[index], &empty,
+                                                  line, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        existing = line;
+      else
+        existing = empty;
+    }
+
+    if (existing == line) {
+      atomic_fetch_add_explicit(&sampleCounts[index], 1, memory_order_relaxed);
+      return;
+    }
+
+    index = (index + 1) & (SAMPLE_TABLE_SIZE - 1);
+  }
+
+  atomic_fetch_add_explicit(&droppedSamples, 1, memory_order_relaxed);
+}
+
+static void handleSample(int signal) {
+  (void)signal;
+
+  Chunk *chunk = sampledVM->chunk;
+  uint8_t *ip = sampledVM->ip;
+  if (chunk == NULL || ip <= chunk->code || ip > chunk->code + chunk->count ||
+      chunk->lines.count == 0) {
+    atomic_fetch_add_explicit(&outsideSamples, 1, memory_order_relaxed);
+    return;
+  }
+
+  // The instruction being run is the one just before ip.
+  countSample(getLine(chunk, (unsigned)(ip - chunk->code - 1)));
+}
+
+bool startSampler(VM *vm, unsigned intervalMicros) {
+  sampledVM = vm;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleSample;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGPROF, &action, &previousAction) != 0)
+    return false;
+
+  struct itimerval timer = {
+      .it_interval = {intervalMicros / 1000000, intervalMicros % 1000000},
+      .it_value = {intervalMicros / 1000000, intervalMicros % 1000000},
+  };
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    sigaction(SIGPROF, &previousAction, NULL);
+    return false;
+  }
+  return true;
+}
+
+void stopSampler() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sigaction(SIGPROF, &previousAction, NULL);
+}
+
+typedef struct {
+  uint32_t line;
+  uint64_t count;
+} LineSamples;
+
+static int compareByLine(const void *a, const void *b) {
+  uint32_t lineA = ((const LineSamples *)a)->line;
+  uint32_t lineB = ((const LineSamples *)b)->line;
+  return (lineA > lineB) - (lineA < lineB);
+}
+
+bool writeSamples(const char *path, const char *scriptName) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+
+  static LineSamples lines[SAMPLE_TABLE_SIZE];
+  unsigned lineCount = 0;
+  for (unsigned i = 0; i < SAMPLE_TABLE_SIZE; ++i) {
+    uint32_t line = atomic_load(&sampleLines[i]);
+    if (line != 0)
+      lines[lineCount++] = (LineSamples){line, atomic_load(&sampleCounts[i])};
+  }
+  qsort(lines, lineCount, sizeof(LineSamples), compareByLine);
+
+  for (unsigned i = 0; i < lineCount; ++i) {
+    fprintf(file, "%s;line %u %llu\n", scriptName, lines[i].line,
+            (unsigned long long)lines[i].count);
+  }
+
+  uint64_t outside = atomic_load(&outsideSamples);
+  if (outside > 0)
+    fprintf(file, "%s;[not running bytecode] %llu\n", scriptName,
+            (unsigned long long)outside);
+
+  uint64_t dropped = atomic_load(&droppedSamples);
+  if (dropped > 0)
+    fprintf(file, "%s;[too many lines] %llu\n", scriptName,
+            (unsigned long long)dropped);
+
+  bool failed = ferror(file) != 0;
+  return fclose(file) == 0 && !failed;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+// A sampling profiler for Lox source lines. A SIGPROF timer interrupts the VM
+// every so often, and the handler charges a sample to the line of the
+// instruction the VM is running. The normal dispatch loop runs untouched, so
+// the only overhead is the signal itself.
+//
+// The handler reads vm->ip as of the last time run() stored it, which the
+// compiler may put off for a few instructions, so samples can land a little
+// early. Samples taken while no bytecode is running (e.g. while compiling) are
+// counted separately.
+
+#ifndef SAMPLE_INTERVAL_US
+#define SAMPLE_INTERVAL_US 1000
+#endif
+
+// Samples `vm`. Returns false if the timer couldn't be set up.
+bool startSampler(VM *vm, unsigned intervalMicros);
+void stopSampler(void);
+
+// Writes the samples in the collapsed stack format that flame graph tools take
+// (one "frame;frame count" line per stack), with `scriptName` as the root
+// frame. Returns false if the file couldn't be written.
+bool writeSamples(const char *path, const char *scriptName);
@@ -6,18 +6,10 @@
 
 #include "common.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-  unsigned line;
-} Scanner;
-
-static Scanner scanner;
-
-void initScanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void initScanner(Scanner *scanner, const char *source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 }
 
 static bool isAlpha(char c) {
@@ -25,63 +17,66 @@ static bool isAlpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
+static bool isAtEnd(Scanner *scanner) { return *scanner->current == '\0'; }
 
-static char peek() { return *scanner.current; }
+static char peek(Scanner *scanner) { return *scanner->current; }
 
-static char peekNext() { return isAtEnd() ? '\0' : scanner.current[1]; }
+static char peekNext(Scanner *scanner) {
+  return isAtEnd(scanner) ? '\0' : scanner->current[1];
+}
 
-static char advance() { return *scanner.current++; }
+static char advance(Scanner *scanner) { return *scanner->current++; }
 
-static bool match(char expected) {
-  if (isAtEnd())
+static bool match(Scanner *scanner, char expected) {
+  if (isAtEnd(scanner))
     return false;
-  if (peek() != expected)
+  if (peek(scanner) != expected)
     return false;
   // I just wanted to use the comma operator outside a for loop for once :p
-  return advance(), true;
+  return advance(scanner), true;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner *scanner, TokenType type) {
   Token token = {
       .type = type,
-      .start = scanner.start,
-      .length = scanner.current - scanner.start,
-      .line = scanner.line,
+      .start = scanner->start,
+      .length = scanner->current - scanner->start,
+      .line = scanner->line,
   };
   return token;
 }
 
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
   Token token = {
       .type = TOKEN_ERROR,
       .start = message,
       .length = strlen(message),
-      .line = scanner.line,
+      .line = scanner->line,
   };
   return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner *scanner) {
   while (true) {
-    char c = peek();
+    char c = peek(scanner);
     switch (c) {
     case '\n':
-      ++scanner.line;
+      ++scanner->line;
     case ' ':
     case '\r':
     case '\t':
-      advance();
+      advance(scanner);
       break;
 
     case '/':
-      if (peekNext() == '/') {
+      if (peekNext(scanner) == '/') {
         // A comment goes until the end of the line.
-        while (peek() != '\n' && !isAtEnd())
-          advance();
+        while (peek(scanner) != '\n' && !isAtEnd(scanner))
+          advance(scanner);
       } else {
         return;
       }
+      break;
 
     default:
       return;
@@ -89,154 +84,158 @@ static void skipWhitespace() {
   }
 }
 
-static TokenType checkKeyword(size_t start, size_t length, const char *rest,
-                              TokenType type) {
-  if ((size_t)(scanner.current - scanner.start) == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0)
+static TokenType checkKeyword(Scanner *scanner, size_t start, size_t length,
+                              const char *rest, TokenType type) {
+  if ((size_t)(scanner->current - scanner->start) == start + length &&
+      memcmp(scanner->start + start, rest, length) == 0)
     return type;
   return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-  switch (*scanner.start) {
+static TokenType identifierType(Scanner *scanner) {
+  switch (*scanner->start) {
   case 'a':
-    return checkKeyword(1, 2, "nd", TOKEN_AND);
+    return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
   case 'c':
-    return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+    return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
   case 'e':
-    return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+    return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
 
   case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'a':
-        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+        return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
       case 'o':
-        return checkKeyword(2, 1, "r", TOKEN_FOR);
+        return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
       case 'u':
-        return checkKeyword(2, 1, "n", TOKEN_FUN);
+        return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
       }
     }
     break;
 
   case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
+    return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
   case 'n':
-    return checkKeyword(1, 2, "il", TOKEN_NIL);
+    return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
   case 'o':
-    return checkKeyword(1, 1, "r", TOKEN_OR);
+    return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
   case 'p':
-    return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+    return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
   case 'r':
-    return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+    return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
   case 's':
-    return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+    return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
 
   case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'h':
-        return checkKeyword(2, 2, "is", TOKEN_THIS);
+        return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
       case 'r':
-        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+        return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
       }
     }
     break;
 
   case 'v':
-    return checkKeyword(1, 2, "ar", TOKEN_VAR);
+    return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
   case 'w':
-    return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
   }
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while (isAlpha(peek()) || isdigit(peek()))
-    advance();
-  return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+  while (isAlpha(peek(scanner)) || isdigit(peek(scanner)))
+    advance(scanner);
+  return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-  while (isdigit(peek()))
-    advance();
+static Token number(Scanner *scanner) {
+  while (isdigit(peek(scanner)))
+    advance(scanner);
 
   // Look for a fractional part.
-  if (peek() == '.' && isdigit(peekNext())) {
+  if (peek(scanner) == '.' && isdigit(peekNext(scanner))) {
     // Consume the ".".
-    advance();
+    advance(scanner);
 
-    while (isdigit(peek()))
-      advance();
+    while (isdigit(peek(scanner)))
+      advance(scanner);
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-  while (peek() != '"') {
-    if (isAtEnd())
-      return errorToken("Unterminated string.");
+static Token string(Scanner *scanner) {
+  while (peek(scanner) != '"') {
+    if (isAtEnd(scanner))
+      return errorToken(scanner, "Unterminated string.");
 
-    if (peek() == '\n')
-      ++scanner.line;
-    advance();
+    if (peek(scanner) == '\n')
+      ++scanner->line;
+    advance(scanner);
   }
 
   // The closing quote.
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-  skipWhitespace();
-  scanner.start = scanner.current;
+Token scanToken(Scanner *scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (isAtEnd())
-    return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner))
+    return makeToken(scanner, TOKEN_EOF);
 
-  char c = advance();
+  char c = advance(scanner);
   if (isAlpha(c))
-    return identifier();
+    return identifier(scanner);
   if (isdigit(c))
-    return number();
+    return number(scanner);
 
   switch (c) {
   case '(':
-    return makeToken(TOKEN_LEFT_PAREN);
+    return makeToken(scanner, TOKEN_LEFT_PAREN);
   case ')':
-    return makeToken(TOKEN_RIGHT_PAREN);
+    return makeToken(scanner, TOKEN_RIGHT_PAREN);
   case '{':
-    return makeToken(TOKEN_LEFT_BRACE);
+    return makeToken(scanner, TOKEN_LEFT_BRACE);
   case '}':
-    return makeToken(TOKEN_RIGHT_BRACE);
+    return makeToken(scanner, TOKEN_RIGHT_BRACE);
   case ';':
-    return makeToken(TOKEN_SEMICOLON);
+    return makeToken(scanner, TOKEN_SEMICOLON);
   case ',':
-    return makeToken(TOKEN_COMMA);
+    return makeToken(scanner, TOKEN_COMMA);
   case '.':
-    return makeToken(TOKEN_DOT);
+    return makeToken(scanner, TOKEN_DOT);
   case '-':
-    return makeToken(TOKEN_MINUS);
+    return makeToken(scanner, TOKEN_MINUS);
   case '+':
-    return makeToken(TOKEN_PLUS);
+    return makeToken(scanner, TOKEN_PLUS);
   case '/':
-    return makeToken(TOKEN_SLASH);
+    return makeToken(scanner, TOKEN_SLASH);
   case '*':
-    return makeToken(TOKEN_STAR);
+    return makeToken(scanner, TOKEN_STAR);
   case '!':
-    return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '=':
-    return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
   case '<':
-    return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '>':
-    return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
   case '"':
-    return string();
+    return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
 
 #pragma push_macro("EOF")
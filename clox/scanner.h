@@ -63,6 +63,12 @@ typedef struct {
   unsigned line;
 } Token;
 
-void initScanner(const char *source);
-Token scanToken(void);
+typedef struct {
+  const char *start;
+  const char *current;
+  unsigned line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
+Token scanToken(Scanner *scanner);
 const char *getTokenTypeName(TokenType type);
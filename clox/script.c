@@ -0,0 +1,90 @@
+#include "script.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+char *readFile(const char *path, FILE *err) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(err, "Could not open file \"%s\".\n", path);
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char *buffer = malloc(fileSize + 1);
+  if (!buffer) {
+    fprintf(err, "Not enough memory to read \"%s\".\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  if (bytesRead < fileSize) {
+    fprintf(err, "Could not read file \"%s\".\n", path);
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  buffer[bytesRead] = '\0';
+
+  fclose(file);
+  return buffer;
+}
+
+// The compiled chunk is cached in the cache directory under the script's file
+// name: foo.lox is cached in foo.loxc, and anything else gets .loxc appended.
+// Scripts with the same name in different directories share a cache file,
+// which only costs a recompile, since caches are keyed by their source.
+static char *cachePathFor(const char *cacheDir, const char *path) {
+  const char *name = strrchr(path, '/');
+  name = name == NULL ? path : name + 1;
+  size_t length = strlen(name);
+  bool isLox = length >= 4 && strcmp(name + length - 4, ".lox") == 0;
+  const char *suffix = isLox ? "c" : ".loxc";
+
+  char *cachePath = malloc(strlen(cacheDir) + 1 + length + strlen(suffix) + 1);
+  if (!cachePath)
+    return NULL;
+
+  strcpy(cachePath, cacheDir);
+  strcat(cachePath, "/");
+  strcat(cachePath, name);
+  strcat(cachePath, suffix);
+  return cachePath;
+}
+
+int runFile(VM *vm, const char *path, const char *cacheDir) {
+  char *source = readFile(path, vm->err);
+  if (source == NULL)
+    return EX_IOERR;
+
+  InterpretResult result;
+  if (cacheDir == NULL) {
+    result = interpret(vm, source);
+  } else {
+    char *cachePath = cachePathFor(cacheDir, path);
+    if (cachePath == NULL) {
+      fprintf(vm->err, "Not enough memory to cache \"%s\".\n", path);
+      free(source);
+      return EX_IOERR;
+    }
+    result = interpretCached(vm, source, cachePath);
+    free(cachePath);
+  }
+  free(source);
+
+  switch (result) {
+  case INTERPRET_OK:
+    return 0;
+  case INTERPRET_COMPILE_ERROR:
+    return EX_DATAERR;
+  case INTERPRET_RUNTIME_ERROR:
+    return EX_SOFTWARE;
+  }
+  __builtin_unreachable();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Running scripts from files, shared by the command line and batch mode.
+
+// Returns the contents of `path`, or NULL after reporting the error to `err`.
+char *readFile(const char *path, FILE *err);
+
+// Runs the script at `path` in `vm`. If `cacheDir` isn't NULL, the compiled
+// script is cached there (see cache.h), and the cache is reused as long as the
+// script doesn't change. Errors go to the VM's error stream. Returns the exit
+// code clox should exit with: 0 on success, or one of the sysexits.h codes.
+int runFile(VM *vm, const char *path, const char *cacheDir);
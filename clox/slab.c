@@ -0,0 +1,128 @@
+// MAP_ANONYMOUS and madvise aren't in POSIX 2008, so ask for glibc's default
+// extensions.
+#define _DEFAULT_SOURCE
+
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// AddressSanitizer can't see inside the arenas by itself, so blocks that
+// aren't handed out are poisoned, which keeps use-after-free bugs in the old
+// generation as visible as they were with malloc.
+#if defined(__SANITIZE_ADDRESS__)
+#define SLAB_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SLAB_ASAN
+#endif
+#endif
+
+#ifdef SLAB_ASAN
+#include <sanitizer/asan_interface.h>
+#define POISON(address, size) ASAN_POISON_MEMORY_REGION(address, size)
+#define UNPOISON(address, size) ASAN_UNPOISON_MEMORY_REGION(address, size)
+#else
+#define POISON(address, size) ((void)(address), (void)(size))
+#define UNPOISON(address, size) ((void)(address), (void)(size))
+#endif
+
+// The arena header takes up the first granule, so blocks stay aligned.
+_Static_assert(sizeof(Arena) <= SLAB_GRANULE, "Arena header is too big");
+
+void initSlabs(Slabs *slabs) {
+  for (unsigned i = 0; i < SLAB_CLASS_COUNT; ++i)
+    slabs->freeLists[i] = NULL;
+  slabs->arenas = NULL;
+  slabs->top = NULL;
+  slabs->end = NULL;
+}
+
+void freeSlabs(Slabs *slabs) {
+  Arena *arena = slabs->arenas;
+  while (arena != NULL) {
+    Arena *next = arena->next;
+    munmap(arena, SLAB_ARENA_SIZE);
+    arena = next;
+  }
+  initSlabs(slabs);
+}
+
+static unsigned sizeClass(size_t size) {
+  return (unsigned)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+size_t slabSize(size_t size) {
+  if (size > SLAB_MAX_SIZE)
+    return size;
+  return (sizeClass(size) + 1) * (size_t)SLAB_GRANULE;
+}
+
+// Maps twice the arena size and trims it, since huge pages only back memory
+// that's aligned to them.
+static Arena *mapArena(void) {
+  size_t mappedSize = 2 * SLAB_ARENA_SIZE;
+  uint8_t *mapped = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED)
+    return NULL;
+
+  uintptr_t address = (uintptr_t)mapped;
+  uintptr_t aligned =
+      (address + SLAB_ARENA_SIZE - 1) & ~(uintptr_t)(SLAB_ARENA_SIZE - 1);
+  size_t head = aligned - address;
+  if (head > 0)
+    munmap(mapped, head);
+  munmap((uint8_t *)aligned + SLAB_ARENA_SIZE, SLAB_ARENA_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+  // Only a hint. It's fine for it to fail.
+  madvise((void *)aligned, SLAB_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+  return (Arena *)aligned;
+}
+
+void *slabAllocate(Slabs *slabs, size_t size) {
+  if (size > SLAB_MAX_SIZE)
+    return malloc(size);
+
+  unsigned class = sizeClass(size);
+  size_t blockSize = slabSize(size);
+  SlabBlock *block = slabs->freeLists[class];
+  if (block != NULL) {
+    UNPOISON(block, blockSize);
+    slabs->freeLists[class] = block->next;
+    return block;
+  }
+
+  // Whatever's left at the end of the old arena is too small to bother with.
+  if ((size_t)(slabs->end - slabs->top) < blockSize) {
+    Arena *arena = mapArena();
+    if (arena == NULL)
+      return NULL;
+    arena->next = slabs->arenas;
+    slabs->arenas = arena;
+    slabs->top = (uint8_t *)arena + SLAB_GRANULE;
+    slabs->end = (uint8_t *)arena + SLAB_ARENA_SIZE;
+    POISON(slabs->top, (size_t)(slabs->end - slabs->top));
+  }
+
+  block = (SlabBlock *)slabs->top;
+  slabs->top += blockSize;
+  UNPOISON(block, blockSize);
+  return block;
+}
+
+void slabFree(Slabs *slabs, void *block, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    free(block);
+    return;
+  }
+
+  unsigned class = sizeClass(size);
+  SlabBlock *freed = block;
+  freed->next = slabs->freeLists[class];
+  slabs->freeLists[class] = freed;
+  POISON(block, slabSize(size));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+// The old generation's allocator. Objects promoted out of the nursery are
+// mostly small and mostly the same few sizes, so rather than going to malloc
+// for each one, blocks of up to SLAB_MAX_SIZE bytes are carved out of big
+// arenas in size classes SLAB_GRANULE bytes apart. A freed block goes on its
+// class's free list, and the next allocation of that class takes it back.
+// Anything bigger goes to malloc.
+//
+// Arenas are aligned to their size and, where the kernel supports it, backed
+// by transparent huge pages, which saves TLB misses when sweeping a big heap.
+// They're only returned to the system when the slabs are freed.
+#define SLAB_GRANULE 16
+#define SLAB_CLASS_COUNT 16
+#define SLAB_MAX_SIZE (SLAB_GRANULE * SLAB_CLASS_COUNT)
+#define SLAB_ARENA_SIZE (2 * 1024 * 1024)
+
+typedef struct SlabBlock {
+  struct SlabBlock *next;
+} SlabBlock;
+
+typedef struct Arena {
+  struct Arena *next;
+} Arena;
+
+typedef struct {
+  SlabBlock *freeLists[SLAB_CLASS_COUNT];
+  // Every arena, and the part of the newest one that hasn't been handed out.
+  Arena *arenas;
+  uint8_t *top;
+  uint8_t *end;
+} Slabs;
+
+void initSlabs(Slabs *slabs);
+void freeSlabs(Slabs *slabs);
+// How many bytes a block of `size` bytes really takes up.
+size_t slabSize(size_t size);
+// Returns NULL if there's no memory left.
+void *slabAllocate(Slabs *slabs, size_t size);
+// `size` must be what the block was allocated with.
+void slabFree(Slabs *slabs, void *block, size_t size);
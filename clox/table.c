@@ -3,119 +3,228 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Slots are probed a group at a time, and groups are aligned, so the capacity
+// is always a power of two that's at least a full group.
+#define GROUP_WIDTH 16
+
+// Control bytes. Full slots store the low seven bits of their key's hash (see
+// h2), so the high bit alone tells free slots from full ones.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// Swiss tables stay fast at much higher loads than linear probing does.
+static unsigned maxLoad(unsigned capacity) { return capacity - capacity / 8; }
+
+// The hash is split in two: the high bits pick the group to start probing at,
+// and the low seven bits are stored in the control byte.
+static unsigned h1(uint32_t hash) { return hash >> 7; }
+static uint8_t h2(uint32_t hash) { return hash & 0x7f; }
+
+// Bitmasks with bit i set if control byte i of the group matches.
+#ifdef __SSE2__
+static unsigned matchByte(const uint8_t *group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (unsigned)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+static unsigned matchFree(const uint8_t *group) {
+  return (unsigned)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+}
+#else
+static unsigned matchByte(const uint8_t *group, uint8_t byte) {
+  unsigned mask = 0;
+  for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+    mask |= (unsigned)(group[i] == byte) << i;
+  return mask;
+}
+
+static unsigned matchFree(const uint8_t *group) {
+  unsigned mask = 0;
+  for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+    mask |= (unsigned)(group[i] >> 7) << i;
+  return mask;
+}
+#endif
+
+static unsigned matchEmpty(const uint8_t *group) {
+  return matchByte(group, CONTROL_EMPTY);
+}
+
+// Probing visits groups in triangular-number order, which hits every group
+// exactly once when the group count is a power of two.
+typedef struct {
+  unsigned group;
+  unsigned stride;
+  unsigned mask;
+} ProbeSequence;
+
+static ProbeSequence startProbe(unsigned capacity, uint32_t hash) {
+  unsigned mask = capacity / GROUP_WIDTH - 1;
+  return (ProbeSequence){h1(hash) & mask, 0, mask};
+}
+
+static void nextProbe(ProbeSequence *probe) {
+  ++probe->stride;
+  probe->group = (probe->group + probe->stride) & probe->mask;
+}
+
+static unsigned firstBit(unsigned mask) { return __builtin_ctz(mask); }
 
 void initTable(Table *table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
-void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM *vm, Table *table) {
+  FREE_ARRAY(vm, MEM_TABLES, uint8_t, table->control, table->capacity);
+  FREE_ARRAY(vm, MEM_TABLES, Entry, table->entries, table->capacity);
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, unsigned capacity, ObjString *key) {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-
-  while (true) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (isNil(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+// Returns the slot holding `key`, or -1 if there isn't one.
+static int findSlot(Table *table, ObjString *key) {
+  if (table->count == 0)
+    return -1;
+
+  uint8_t fragment = h2(key->hash);
+  for (ProbeSequence probe = startProbe(table->capacity, key->hash);;
+       nextProbe(&probe)) {
+    unsigned base = probe.group * GROUP_WIDTH;
+    const uint8_t *group = &table->control[base];
+    for (unsigned match = matchByte(group, fragment); match != 0;
+         match &= match - 1) {
+      unsigned slot = base + firstBit(match);
+      if (table->entries[slot].key == key)
+        return (int)slot;
     }
 
-    index = (index + 1) % capacity;
+    // An empty slot would have ended any insertion's probe here.
+    if (matchEmpty(group) != 0)
+      return -1;
   }
 }
 
-static void adjustCapacity(Table *table, unsigned capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (unsigned i = 0; i < capacity; ++i) {
-    entries[i].key = NULL;
-    entries[i].value = nilVal();
+// Returns the first empty or deleted slot along `hash`'s probe sequence. There
+// always is one, since the load factor is capped below one.
+static unsigned findFreeSlot(uint8_t *control, unsigned capacity,
+                             uint32_t hash) {
+  for (ProbeSequence probe = startProbe(capacity, hash);; nextProbe(&probe)) {
+    unsigned base = probe.group * GROUP_WIDTH;
+    unsigned match = matchFree(&control[base]);
+    if (match != 0)
+      return base + firstBit(match);
   }
+}
 
-  table->count = 0;
+static void adjustCapacity(VM *vm, Table *table, unsigned capacity) {
+  uint8_t *control = ALLOCATE(vm, MEM_TABLES, uint8_t, capacity);
+  Entry *entries = ALLOCATE(vm, MEM_TABLES, Entry, capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+
+  // Rehashing drops all the tombstones.
   for (unsigned i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL)
+    if (table->control[i] & 0x80)
       continue;
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    ++table->count;
+    Entry *entry = &table->entries[i];
+    unsigned slot = findFreeSlot(control, capacity, entry->key->hash);
+    control[slot] = table->control[i];
+    entries[slot] = *entry;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(vm, MEM_TABLES, uint8_t, table->control, table->capacity);
+  FREE_ARRAY(vm, MEM_TABLES, Entry, table->entries, table->capacity);
+  table->control = control;
   table->entries = entries;
   table->capacity = capacity;
+  table->tombstones = 0;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
-  if (table->count == 0)
-    return false;
-
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int slot = findSlot(table, key);
+  if (slot < 0)
     return false;
 
-  *value = entry->value;
+  *value = table->entries[slot].value;
   return true;
 }
 
-bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    unsigned capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+Entry *tableEntry(Table *table, ObjString *key) {
+  int slot = findSlot(table, key);
+  return slot < 0 ? NULL : &table->entries[slot];
+}
+
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value) {
+  // Tables outlive the nursery, so they have to be told about young objects
+  // being stored in them.
+  int existing = findSlot(table, key);
+  if (existing >= 0) {
+    table->entries[existing].value = value;
+    if (isYoungValue(vm, value))
+      rememberTableKey(vm, table, key);
+    return false;
+  }
+
+  if (isYoung(vm, (Obj *)key) || isYoungValue(vm, value))
+    rememberTableKey(vm, table, key);
+
+  if (table->count + table->tombstones + 1 > maxLoad(table->capacity)) {
+    // If tombstones are what's filling the table up, rehashing at the same
+    // size is enough to make room.
+    unsigned capacity = table->capacity;
+    if (table->count + 1 > maxLoad(capacity) / 2)
+      capacity = capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity * 2;
+    adjustCapacity(vm, table, capacity);
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && isNil(entry->value))
-    ++table->count;
+  unsigned slot = findFreeSlot(table->control, table->capacity, key->hash);
+  if (table->control[slot] == CONTROL_DELETED)
+    --table->tombstones;
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  table->control[slot] = h2(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+  ++table->count;
+  return true;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
-  if (table->count == 0)
+  int slot = findSlot(table, key);
+  if (slot < 0)
     return false;
 
-  // Find the entry.
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
-    return false;
+  // Probes only continue past a group that has no empty slots. If this group
+  // already has one, no probe can depend on this slot being occupied, and we
+  // can mark it empty instead of leaving a tombstone behind.
+  unsigned base = (unsigned)slot / GROUP_WIDTH * GROUP_WIDTH;
+  if (matchEmpty(&table->control[base]) != 0) {
+    table->control[slot] = CONTROL_EMPTY;
+  } else {
+    table->control[slot] = CONTROL_DELETED;
+    ++table->tombstones;
+  }
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = boolVal(true);
+  --table->count;
   return true;
 }
 
-void tableAddAll(Table *from, Table *to) {
+void tableAddAll(VM *vm, Table *from, Table *to) {
   for (unsigned i = 0; i < from->capacity; ++i) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL)
-      tableSet(to, entry->key, entry->value);
+    if (!(from->control[i] & 0x80))
+      tableSet(vm, to, from->entries[i].key, from->entries[i].value);
   }
 }
 
@@ -124,19 +233,38 @@ ObjString *tableFindString(Table *table, const char *chars, unsigned length,
   if (table->count == 0)
     return NULL;
 
-  uint32_t index = hash % table->capacity;
-  while (true) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (isNil(entry->value))
-        return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+  uint8_t fragment = h2(hash);
+  for (ProbeSequence probe = startProbe(table->capacity, hash);;
+       nextProbe(&probe)) {
+    unsigned base = probe.group * GROUP_WIDTH;
+    const uint8_t *group = &table->control[base];
+    for (unsigned match = matchByte(group, fragment); match != 0;
+         match &= match - 1) {
+      ObjString *key = table->entries[base + firstBit(match)].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0)
+        return key;
     }
 
-    index = (index + 1) % table->capacity;
+    if (matchEmpty(group) != 0)
+      return NULL;
+  }
+}
+
+void markTable(VM *vm, Table *table) {
+  for (unsigned i = 0; i < table->capacity; ++i) {
+    if (table->control[i] & 0x80)
+      continue;
+
+    markObject(vm, (Obj *)table->entries[i].key);
+    markValue(vm, table->entries[i].value);
+  }
+}
+
+// For weak tables: drops every entry whose key is about to be swept.
+void tableRemoveWhite(Table *table) {
+  for (unsigned i = 0; i < table->capacity; ++i) {
+    if (!(table->control[i] & 0x80) && !table->entries[i].key->obj.isMarked)
+      tableDelete(table, table->entries[i].key);
   }
 }
@@ -8,17 +8,29 @@ typedef struct {
   Value value;
 } Entry;
 
+// A Swiss table: open addressing over a power-of-two number of slots, with a
+// separate array of one-byte control words. A full slot's control byte holds
+// seven bits of its key's hash, so lookups can compare a whole group of slots
+// at once (with SSE2 where available) and only touch the entries that are
+// likely matches. The entries of empty and deleted slots are garbage.
 typedef struct {
   unsigned count;
+  unsigned tombstones;
   unsigned capacity;
+  uint8_t *control;
   Entry *entries;
 } Table;
 
 void initTable(Table *table);
-void freeTable(Table *table);
+void freeTable(VM *vm, Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
-bool tableSet(Table *table, ObjString *key, Value value);
+// Returns the entry for `key`, or NULL if there isn't one. The pointer is only
+// valid until the table is next modified.
+Entry *tableEntry(Table *table, ObjString *key);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
-void tableAddAll(Table *from, Table *to);
+void tableAddAll(VM *vm, Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, unsigned length,
                            uint32_t hash);
+void markTable(VM *vm, Table *table);
+void tableRemoveWhite(Table *table);
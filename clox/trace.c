@@ -0,0 +1,45 @@
+#include "trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void initTracer(Tracer *tracer, unsigned capacity) {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0 &&
+         "Trace capacity must be a power of two");
+  // The buffer is deliberately not counted as part of the heap.
+  tracer->records = malloc(sizeof(TraceRecord) * capacity);
+  if (tracer->records == NULL)
+    exit(1);
+  tracer->capacity = capacity;
+  tracer->count = 0;
+}
+
+void freeTracer(Tracer *tracer) {
+  free(tracer->records);
+  tracer->records = NULL;
+  tracer->capacity = 0;
+  tracer->count = 0;
+}
+
+bool dumpTrace(Tracer *tracer, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+
+  bool wrapped = tracer->count > tracer->capacity;
+  unsigned recordCount = wrapped ? tracer->capacity : (unsigned)tracer->count;
+  TraceFileHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord),
+                            recordCount, tracer->count};
+  fwrite(&header, sizeof(header), 1, file);
+
+  // Once the buffer has wrapped around, the oldest record is the one that
+  // would be overwritten next.
+  unsigned oldest = wrapped ? tracer->count & (tracer->capacity - 1) : 0;
+  fwrite(tracer->records + oldest, sizeof(TraceRecord), recordCount - oldest,
+         file);
+  fwrite(tracer->records, sizeof(TraceRecord), oldest, file);
+
+  bool failed = ferror(file) != 0;
+  return fclose(file) == 0 && !failed;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+
+// Execution tracing. When a tracer is installed (vm->tracer), the VM runs a
+// separate copy of its dispatch loop that records every instruction it's about
+// to execute into a ring buffer, so the buffer always holds the most recent
+// instructions. The normal dispatch loop has no tracing code at all.
+//
+// A dumped trace file is a TraceFileHeader followed by the records, oldest
+// first, all in native byte order.
+
+#define TRACE_MAGIC 0x54584f4c // "LOXT"
+#define TRACE_VERSION 1
+
+// The default number of records kept. Must be a power of two.
+#ifndef TRACE_CAPACITY
+#define TRACE_CAPACITY (64 * 1024)
+#endif
+
+typedef struct {
+  // Where the instruction is in the chunk that was running at the time.
+  uint32_t offset;
+  uint8_t opcode;
+  uint8_t reserved;
+  // The number of values on the stack before the instruction runs.
+  uint16_t stackDepth;
+} TraceRecord;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t recordCount;
+  // Including the ones that were overwritten.
+  uint64_t instructionCount;
+} TraceFileHeader;
+
+typedef struct {
+  TraceRecord *records;
+  unsigned capacity;
+  uint64_t count;
+} Tracer;
+
+void initTracer(Tracer *tracer, unsigned capacity);
+void freeTracer(Tracer *tracer);
+// Returns false if the file couldn't be written.
+bool dumpTrace(Tracer *tracer, const char *path);
+
+// See value.h for an explanation.
+#define ALWAYS_INLINE __attribute__((__always_inline__)) inline
+
+ALWAYS_INLINE void traceInstruction(Tracer *tracer, uint32_t offset,
+                                    uint8_t opcode, uint16_t stackDepth) {
+  tracer->records[tracer->count++ & (tracer->capacity - 1)] =
+      (TraceRecord){offset, opcode, 0, stackDepth};
+}
+
+#undef ALWAYS_INLINE
@@ -0,0 +1,645 @@
+#include "tracejit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "x64.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+// In a trace, rbx holds the VM, the locals below the header's stack depth live
+// in xmm8-15, and the values above it (temporaries, and locals declared inside
+// the loop) live in xmm2-7, one register per stack slot. rax, rdx, xmm0 and
+// xmm1 are scratch.
+#define LOCAL_REGISTERS 8
+#define FIRST_LOCAL_REGISTER 8
+#define STACK_REGISTERS 6
+#define FIRST_STACK_REGISTER 2
+// Room to save every xmm register around a call, since the ABI doesn't
+// preserve any of them. It also keeps rsp 16-byte aligned for the call.
+#define SPILL_SIZE (16 * 8)
+
+// What the trace knows about a value above the header's stack depth.
+typedef enum {
+  // A number, in its stack slot's register.
+  STACK_NUMBER,
+  // A bool that's known while compiling.
+  STACK_BOOL,
+  // A comparison whose result is still in the flags. It's `boolean` if
+  // `condition` (ABOVE, or EQUAL and not unordered) holds, and the opposite if
+  // not. Only OP_NOT and OP_JUMP_IF_FALSE can use one.
+  STACK_CONDITION,
+} StackValueKind;
+
+typedef struct {
+  StackValueKind kind;
+  bool boolean;
+  Condition condition;
+} StackValue;
+
+// Where a guard leaves the trace: the jumps to it, the instruction the
+// interpreter resumes at, and what's on the stack above the header's depth.
+typedef struct {
+  unsigned jumps[2];
+  unsigned jumpCount;
+  unsigned offset;
+  unsigned depth;
+  StackValue entries[STACK_REGISTERS];
+} SideExit;
+
+typedef struct {
+  Assembler as;
+  Chunk *chunk;
+  Recording *recording;
+  // Which register holds each local below the header's stack depth, or 0 if
+  // the trace doesn't use it.
+  uint8_t localRegisters[STACK_MAX];
+  StackValue entries[STACK_REGISTERS];
+  unsigned depth;
+  SideExit *exits;
+  unsigned exitCount;
+} TraceCompiler;
+
+static HotLoop *findHotLoop(VM *vm, Chunk *chunk, unsigned header) {
+  unsigned low = 0;
+  unsigned high = chunk->hotLoopCount;
+  while (low < high) {
+    unsigned middle = low + (high - low) / 2;
+    if (chunk->hotLoops[middle].header < header)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low < chunk->hotLoopCount && chunk->hotLoops[low].header == header)
+    return &chunk->hotLoops[low];
+
+  if (chunk->hotLoopCapacity < chunk->hotLoopCount + 1) {
+    unsigned oldCapacity = chunk->hotLoopCapacity;
+    chunk->hotLoopCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->hotLoops = GROW_ARRAY(vm, MEM_JIT, HotLoop, chunk->hotLoops,
+                                 oldCapacity, chunk->hotLoopCapacity);
+  }
+  HotLoop *loop = &chunk->hotLoops[low];
+  memmove(loop + 1, loop, (chunk->hotLoopCount - low) * sizeof(HotLoop));
+  ++chunk->hotLoopCount;
+  *loop = (HotLoop){.header = header};
+  return loop;
+}
+
+static int32_t slotDisp(unsigned slot) {
+  return (int32_t)offsetof(VM, stack) + (int32_t)slot * VALUE_SIZE;
+}
+
+static unsigned stackRegister(unsigned position) {
+  return FIRST_STACK_REGISTER + position;
+}
+
+static unsigned topRegister(TraceCompiler *tc, unsigned distance) {
+  return stackRegister(tc->depth - 1 - distance);
+}
+
+static bool isNumberAt(TraceCompiler *tc, unsigned distance) {
+  return tc->depth > distance &&
+         tc->entries[tc->depth - 1 - distance].kind == STACK_NUMBER;
+}
+
+static bool pushValue(TraceCompiler *tc, StackValue entry) {
+  if (tc->depth == STACK_REGISTERS)
+    return false;
+  tc->entries[tc->depth++] = entry;
+  return true;
+}
+
+static bool pushNumber(TraceCompiler *tc) {
+  return pushValue(tc, (StackValue){.kind = STACK_NUMBER});
+}
+
+static void emitMoveXmm(Assembler *as, unsigned to, unsigned from) {
+  if (to != from)
+    emitSseRegisters(as, SD, MOVSD_LOAD, to, from);
+}
+
+static void emitEpilogue(Assembler *as) {
+  // add rsp, SPILL_SIZE; pop rbx; ret
+  emitAddImmediate(as, RSP, SPILL_SIZE);
+  EMIT(as, 0x5b, 0xc3);
+}
+
+// Starts a side exit that resumes at the instruction at `offset` with the stack
+// as it is now. The caller adds the jumps to it.
+static SideExit *addExit(TraceCompiler *tc, unsigned offset) {
+  SideExit *sideExit = &tc->exits[tc->exitCount++];
+  sideExit->jumpCount = 0;
+  sideExit->offset = offset;
+  sideExit->depth = tc->depth;
+  memcpy(sideExit->entries, tc->entries, sizeof(tc->entries));
+  return sideExit;
+}
+
+// Jumps to `sideExit` if whether `condition` holds after the last ucomisd is
+// `holds`.
+static void emitConditionExit(Assembler *as, SideExit *sideExit,
+                              Condition condition, bool holds) {
+  unsigned *jumps = sideExit->jumps;
+  if (condition == ABOVE) {
+    jumps[sideExit->jumpCount++] =
+        emitJump(as, holds ? ABOVE : BELOW_OR_EQUAL);
+  } else if (holds) {
+    // Equal is ZF set with PF clear, since unordered sets both.
+    unsigned unordered = emitJump(as, PARITY);
+    jumps[sideExit->jumpCount++] = emitJump(as, EQUAL);
+    patchJump(as, unordered);
+  } else {
+    jumps[sideExit->jumpCount++] = emitJump(as, NOT_EQUAL);
+    jumps[sideExit->jumpCount++] = emitJump(as, PARITY);
+  }
+}
+
+static void emitSideExit(TraceCompiler *tc, SideExit *sideExit) {
+  Assembler *as = &tc->as;
+  for (unsigned i = 0; i < sideExit->jumpCount; ++i)
+    patchJump(as, sideExit->jumps[i]);
+
+  // Box everything back into vm->stack. Locals only ever hold numbers in a
+  // trace, so none of this needs a write barrier.
+  unsigned stackDepth = tc->recording->stackDepth;
+  for (unsigned slot = 0; slot < stackDepth; ++slot) {
+    if (tc->localRegisters[slot] != 0)
+      emitStoreNumber(as, RBX, slotDisp(slot), tc->localRegisters[slot]);
+  }
+  for (unsigned i = 0; i < sideExit->depth; ++i) {
+    StackValue *entry = &sideExit->entries[i];
+    int32_t disp = slotDisp(stackDepth + i);
+    if (entry->kind == STACK_NUMBER)
+      emitStoreNumber(as, RBX, disp, stackRegister(i));
+    else
+      emitStoreValue(as, RBX, disp, boolVal(entry->boolean));
+  }
+
+  // lea rax, [rbx + disp]
+  EMIT(as, REX_W, 0x8d);
+  emitModRM(as, RAX, RBX, slotDisp(stackDepth + sideExit->depth));
+  emitStore(as, RBX, offsetof(VM, stackTop), RAX);
+  emitLoadImmediate(as, RAX, (uintptr_t)&tc->chunk->code[sideExit->offset]);
+  emitStore(as, RBX, offsetof(VM, ip), RAX);
+  emitEpilogue(as);
+}
+
+static void emitLoadNumber(Assembler *as, unsigned xmm, double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  emitLoadImmediate(as, RAX, bits);
+  emitMovqToXmm(as, xmm, RAX);
+}
+
+static bool getLocal(TraceCompiler *tc, uint8_t slot) {
+  unsigned stackDepth = tc->recording->stackDepth;
+  if (slot < stackDepth) {
+    if (!pushNumber(tc))
+      return false;
+    emitMoveXmm(&tc->as, topRegister(tc, 0), tc->localRegisters[slot]);
+    return true;
+  }
+
+  unsigned position = slot - stackDepth;
+  if (position >= tc->depth || !pushValue(tc, tc->entries[position]))
+    return false;
+  if (tc->entries[position].kind == STACK_NUMBER)
+    emitMoveXmm(&tc->as, topRegister(tc, 0), stackRegister(position));
+  return true;
+}
+
+static bool setLocal(TraceCompiler *tc, uint8_t slot) {
+  unsigned stackDepth = tc->recording->stackDepth;
+  if (slot < stackDepth) {
+    if (!isNumberAt(tc, 0))
+      return false;
+    emitMoveXmm(&tc->as, tc->localRegisters[slot], topRegister(tc, 0));
+    return true;
+  }
+
+  unsigned position = slot - stackDepth;
+  if (position >= tc->depth)
+    return false;
+  tc->entries[position] = tc->entries[tc->depth - 1];
+  if (tc->entries[position].kind == STACK_NUMBER)
+    emitMoveXmm(&tc->as, stackRegister(position), topRegister(tc, 0));
+  return true;
+}
+
+static bool getGlobal(TraceCompiler *tc, unsigned offset, uint16_t slot) {
+  if (tc->depth == STACK_REGISTERS)
+    return false;
+
+  // An undefined global isn't a number either, so the interpreter reports it.
+  Assembler *as = &tc->as;
+  int32_t disp = slot * VALUE_SIZE;
+  SideExit *sideExit = addExit(tc, offset);
+  emitLoad(as, RAX, RBX, offsetof(VM, globalValues.values));
+  sideExit->jumps[sideExit->jumpCount++] = emitJumpUnlessNumber(as, RAX, disp);
+  emitLoad(as, RAX, RBX, offsetof(VM, globalValues.values));
+  pushNumber(tc);
+  emitSse(as, SD, MOVSD_LOAD, topRegister(tc, 0), RAX, disp + PAYLOAD);
+  return true;
+}
+
+static bool setGlobal(TraceCompiler *tc, unsigned offset, uint16_t slot) {
+  if (!isNumberAt(tc, 0))
+    return false;
+
+  Assembler *as = &tc->as;
+  int32_t disp = slot * VALUE_SIZE;
+  SideExit *sideExit = addExit(tc, offset);
+  emitLoad(as, RAX, RBX, offsetof(VM, globalValues.values));
+  sideExit->jumps[sideExit->jumpCount++] = emitJumpIfUndefined(as, RAX, disp);
+  emitLoad(as, RAX, RBX, offsetof(VM, globalValues.values));
+  emitStoreNumber(as, RAX, disp, topRegister(tc, 0));
+  return true;
+}
+
+static bool emitArithmetic(TraceCompiler *tc, uint8_t opcode) {
+  if (!isNumberAt(tc, 0) || !isNumberAt(tc, 1))
+    return false;
+  emitSseRegisters(&tc->as, SD, opcode, topRegister(tc, 1), topRegister(tc, 0));
+  --tc->depth;
+  return true;
+}
+
+// Compares the top two numbers, the right one first if `swap` is set. The
+// negated comparisons keep their NaN behavior (see notBoolVal in vm.c) by
+// testing the same condition for the opposite result.
+static bool emitComparison(TraceCompiler *tc, bool swap, Condition condition,
+                           bool boolean) {
+  if (!isNumberAt(tc, 0) || !isNumberAt(tc, 1))
+    return false;
+  unsigned left = topRegister(tc, 1);
+  unsigned right = topRegister(tc, 0);
+  emitSseRegisters(&tc->as, PD, UCOMISD, swap ? right : left,
+                   swap ? left : right);
+  tc->depth -= 2;
+  return pushValue(tc, (StackValue){STACK_CONDITION, boolean, condition});
+}
+
+static bool emitNot(TraceCompiler *tc) {
+  if (tc->depth == 0)
+    return false;
+  StackValue *entry = &tc->entries[tc->depth - 1];
+  if (entry->kind == STACK_NUMBER)
+    *entry = (StackValue){.kind = STACK_BOOL, .boolean = false};
+  else
+    entry->boolean = !entry->boolean;
+  return true;
+}
+
+static bool emitNegate(TraceCompiler *tc) {
+  if (!isNumberAt(tc, 0))
+    return false;
+  Assembler *as = &tc->as;
+  unsigned xmm = topRegister(tc, 0);
+  // Flip the sign bit: xor rax, rdx
+  emitMovqFromXmm(as, RAX, xmm);
+  emitLoadImmediate(as, RDX, (uint64_t)1 << 63);
+  EMIT(as, REX_W, 0x31, 0xd0);
+  emitMovqToXmm(as, xmm, RAX);
+  return true;
+}
+
+static void printNumber(VM *vm, double number) {
+  printValue(vm, vm->out, numberVal(number));
+  fputc('\n', vm->out);
+}
+
+static bool emitPrint(TraceCompiler *tc) {
+  if (!isNumberAt(tc, 0))
+    return false;
+  Assembler *as = &tc->as;
+  emitMoveXmm(as, 0, topRegister(tc, 0));
+  --tc->depth;
+
+  bool live[16] = {false};
+  for (unsigned slot = 0; slot < tc->recording->stackDepth; ++slot)
+    live[tc->localRegisters[slot]] = tc->localRegisters[slot] != 0;
+  for (unsigned i = 0; i < tc->depth; ++i)
+    live[stackRegister(i)] = tc->entries[i].kind == STACK_NUMBER;
+
+  for (unsigned xmm = 0; xmm < 16; ++xmm) {
+    if (live[xmm])
+      emitSse(as, SD, MOVSD_STORE, xmm, RSP, 8 * (int32_t)xmm);
+  }
+  emitMove(as, RDI, RBX);
+  emitLoadImmediate(as, RAX, (uintptr_t)printNumber);
+  // call rax
+  EMIT(as, 0xff, 0xd0);
+  for (unsigned xmm = 0; xmm < 16; ++xmm) {
+    if (live[xmm])
+      emitSse(as, SD, MOVSD_LOAD, xmm, RSP, 8 * (int32_t)xmm);
+  }
+  return true;
+}
+
+// Follows the branch the recording took. If the condition was only known at
+// run time, a guard leaves the trace for the other branch, with the bool
+// OP_JUMP_IF_FALSE would have seen on the stack.
+static bool emitJumpIfFalse(TraceCompiler *tc, unsigned offset, bool truthy) {
+  if (tc->depth == 0)
+    return false;
+  StackValue *entry = &tc->entries[tc->depth - 1];
+  switch (entry->kind) {
+  case STACK_NUMBER:
+    return truthy;
+  case STACK_BOOL:
+    return entry->boolean == truthy;
+  case STACK_CONDITION: {
+    bool exitIfHolds = entry->boolean != truthy;
+    Condition condition = entry->condition;
+    *entry = (StackValue){.kind = STACK_BOOL, .boolean = !truthy};
+    SideExit *sideExit = addExit(tc, offset);
+    emitConditionExit(&tc->as, sideExit, condition, exitIfHolds);
+    entry->boolean = truthy;
+    return true;
+  }
+  }
+  return false;
+}
+
+static bool compileStep(TraceCompiler *tc, unsigned index) {
+  Recording *recording = tc->recording;
+  TraceStep *step = &recording->steps[index];
+  uint8_t *ip = &tc->chunk->code[step->offset];
+  unsigned next = index + 1 < recording->count
+                      ? recording->steps[index + 1].offset
+                      : recording->header;
+  uint16_t slot = 0;
+  if (instructionLength(*ip) == 3)
+    slot = (uint16_t)((ip[1] << 8) | ip[2]);
+
+  // The flags only last until the next instruction that emits code.
+  if (tc->depth > 0 && tc->entries[tc->depth - 1].kind == STACK_CONDITION &&
+      *ip != OP_NOT && *ip != OP_JUMP_IF_FALSE)
+    return false;
+
+  switch ((OpCode)*ip) {
+  case OP_CONSTANT: {
+    Value constant = tc->chunk->constants.values[ip[1]];
+    if (!isNumber(constant) || !pushNumber(tc))
+      return false;
+    emitLoadNumber(&tc->as, topRegister(tc, 0), asNumber(constant));
+    return true;
+  }
+  case OP_TRUE:
+  case OP_FALSE: {
+    StackValue value = {.kind = STACK_BOOL, .boolean = *ip == OP_TRUE};
+    return pushValue(tc, value);
+  }
+  case OP_POP:
+  case OP_POP_N: {
+    unsigned count = *ip == OP_POP ? 1 : ip[1];
+    if (count > tc->depth)
+      return false;
+    tc->depth -= count;
+    return true;
+  }
+  case OP_GET_LOCAL:
+    return getLocal(tc, ip[1]);
+  case OP_SET_LOCAL:
+    return setLocal(tc, ip[1]);
+  case OP_GET_GLOBAL:
+    return step->types[0] == TRACE_NUMBER && getGlobal(tc, step->offset, slot);
+  case OP_SET_GLOBAL:
+    return setGlobal(tc, step->offset, slot);
+  case OP_EQUAL:
+    return emitComparison(tc, false, EQUAL, true);
+  case OP_NOT_EQUAL:
+    return emitComparison(tc, false, EQUAL, false);
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    return emitComparison(tc, false, ABOVE, true);
+  case OP_GREATER_EQUAL:
+    return emitComparison(tc, true, ABOVE, false);
+  case OP_LESS:
+  case OP_LESS_NUM:
+    return emitComparison(tc, true, ABOVE, true);
+  case OP_LESS_EQUAL:
+    return emitComparison(tc, false, ABOVE, false);
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return emitArithmetic(tc, ADDSD);
+  case OP_ADD_LOCALS:
+    return getLocal(tc, ip[1]) && getLocal(tc, ip[2]) &&
+           emitArithmetic(tc, ADDSD);
+  case OP_CONSTANT_ADD: {
+    Value constant = tc->chunk->constants.values[ip[1]];
+    if (!isNumber(constant) || !pushNumber(tc))
+      return false;
+    emitLoadNumber(&tc->as, topRegister(tc, 0), asNumber(constant));
+    return emitArithmetic(tc, ADDSD);
+  }
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    return emitArithmetic(tc, SUBSD);
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    return emitArithmetic(tc, MULSD);
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    return emitArithmetic(tc, DIVSD);
+  case OP_NOT:
+    return emitNot(tc);
+  case OP_NEGATE:
+    return emitNegate(tc);
+  case OP_PRINT:
+    return emitPrint(tc);
+  case OP_JUMP:
+  case OP_LOOP:
+    // The trace is a straight line, so jumps are just where it continues.
+    return true;
+  case OP_JUMP_IF_FALSE:
+    return emitJumpIfFalse(tc, step->offset, next == step->offset + 3);
+  case OP_NIL:
+  case OP_DEFINE_GLOBAL:
+  case OP_RETURN:
+    return false;
+  }
+  return false;
+}
+
+// Gives a register to each local below the header's stack depth that the
+// recording uses. They have to be numbers already, since the trace loads them
+// when it's entered, and it can only store numbers to them.
+static bool allocateLocals(TraceCompiler *tc) {
+  Recording *recording = tc->recording;
+  unsigned count = 0;
+  for (unsigned i = 0; i < recording->count; ++i) {
+    TraceStep *step = &recording->steps[i];
+    uint8_t *ip = &tc->chunk->code[step->offset];
+    unsigned operands =
+        *ip == OP_ADD_LOCALS
+            ? 2
+            : (*ip == OP_GET_LOCAL || *ip == OP_SET_LOCAL ? 1 : 0);
+    for (unsigned j = 0; j < operands; ++j) {
+      uint8_t slot = ip[1 + j];
+      if (slot >= recording->stackDepth)
+        continue;
+      if (*ip != OP_SET_LOCAL && step->types[j] != TRACE_NUMBER)
+        return false;
+      if (tc->localRegisters[slot] != 0)
+        continue;
+      if (count == LOCAL_REGISTERS)
+        return false;
+      tc->localRegisters[slot] = (uint8_t)(FIRST_LOCAL_REGISTER + count++);
+    }
+  }
+  return true;
+}
+
+static bool compileTrace(TraceCompiler *tc) {
+  if (!allocateLocals(tc))
+    return false;
+
+  // push rbx; mov rbx, rdi; sub rsp, SPILL_SIZE
+  Assembler *as = &tc->as;
+  emitByte(as, 0x53);
+  emitMove(as, RBX, RDI);
+  emitAddImmediate(as, RSP, -SPILL_SIZE);
+
+  // Check the locals' types once on the way in. Nothing in the trace can change
+  // them, so they can stay unboxed from then on.
+  unsigned notEntered[LOCAL_REGISTERS];
+  unsigned notEnteredCount = 0;
+  for (unsigned slot = 0; slot < tc->recording->stackDepth; ++slot) {
+    if (tc->localRegisters[slot] == 0)
+      continue;
+    notEntered[notEnteredCount++] =
+        emitJumpUnlessNumber(as, RBX, slotDisp(slot));
+    emitSse(as, SD, MOVSD_LOAD, tc->localRegisters[slot], RBX,
+            slotDisp(slot) + PAYLOAD);
+  }
+
+  unsigned loopStart = as->count;
+  for (unsigned i = 0; i < tc->recording->count; ++i) {
+    if (!compileStep(tc, i))
+      return false;
+  }
+  if (tc->depth != 0)
+    return false;
+  patchJumpTo(as, emitJump(as, ALWAYS), loopStart);
+
+  for (unsigned i = 0; i < notEnteredCount; ++i)
+    patchJump(as, notEntered[i]);
+  emitEpilogue(as);
+
+  for (unsigned i = 0; i < tc->exitCount; ++i)
+    emitSideExit(tc, &tc->exits[i]);
+  return true;
+}
+
+static void compileRecording(VM *vm) {
+  Recording *recording = vm->recording;
+  TraceCompiler tc = {.chunk = vm->chunk, .recording = recording};
+  initAssembler(&tc.as, vm);
+  // Each instruction has at most one guard.
+  tc.exits = ALLOCATE(vm, MEM_JIT, SideExit, recording->count);
+
+  if (compileTrace(&tc)) {
+    void *code = mapExecutable(&tc.as);
+    if (code != NULL) {
+      HotLoop *loop = findHotLoop(vm, vm->chunk, recording->header);
+      loop->code = code;
+      loop->codeSize = tc.as.count;
+      loop->stackDepth = recording->stackDepth;
+    }
+  }
+
+  FREE_ARRAY(vm, MEM_JIT, SideExit, tc.exits, recording->count);
+  freeAssembler(&tc.as);
+}
+
+LoopAction loopBackEdge(VM *vm) {
+  unsigned header = (unsigned)(vm->ip - vm->chunk->code);
+  HotLoop *loop = findHotLoop(vm, vm->chunk, header);
+  unsigned stackDepth = (unsigned)(vm->stackTop - vm->stack);
+  if (loop->code != NULL) {
+    if (stackDepth == loop->stackDepth)
+      ((void (*)(VM *))loop->code)(vm);
+    return LOOP_INTERPRET;
+  }
+
+  if (loop->attempts == HOT_LOOP_MAX_ATTEMPTS ||
+      ++loop->hits < HOT_LOOP_THRESHOLD)
+    return LOOP_INTERPRET;
+  loop->hits = 0;
+  ++loop->attempts;
+
+  if (vm->recording == NULL)
+    vm->recording = ALLOCATE(vm, MEM_JIT, Recording, 1);
+  vm->recording->header = header;
+  vm->recording->stackDepth = stackDepth;
+  vm->recording->count = 0;
+  return LOOP_RECORD;
+}
+
+static TraceType traceType(Value value) {
+  if (isNumber(value))
+    return TRACE_NUMBER;
+  if (isBool(value))
+    return TRACE_BOOL;
+  return TRACE_OTHER;
+}
+
+bool recordInstruction(VM *vm) {
+  Recording *recording = vm->recording;
+  unsigned offset = (unsigned)(vm->ip - vm->chunk->code);
+  if (offset == recording->header && recording->count > 0) {
+    compileRecording(vm);
+    return false;
+  }
+  if (recording->count == TRACE_MAX_STEPS)
+    return false;
+
+  TraceStep *step = &recording->steps[recording->count++];
+  step->offset = offset;
+  step->types[0] = step->types[1] = TRACE_OTHER;
+  uint8_t *ip = vm->ip;
+  switch (*ip) {
+  case OP_GET_LOCAL:
+    step->types[0] = traceType(vm->stack[ip[1]]);
+    break;
+  case OP_ADD_LOCALS:
+    step->types[0] = traceType(vm->stack[ip[1]]);
+    step->types[1] = traceType(vm->stack[ip[2]]);
+    break;
+  case OP_GET_GLOBAL:
+    step->types[0] =
+        traceType(vm->globalValues.values[(ip[1] << 8) | ip[2]]);
+    break;
+  }
+  return true;
+}
+
+#else
+
+LoopAction loopBackEdge(VM *vm) {
+  (void)vm;
+  return LOOP_INTERPRET;
+}
+
+bool recordInstruction(VM *vm) {
+  (void)vm;
+  return false;
+}
+
+#endif
+
+void freeHotLoops(VM *vm, Chunk *chunk) {
+  for (unsigned i = 0; i < chunk->hotLoopCount; ++i)
+    unmapExecutable(chunk->hotLoops[i].code, chunk->hotLoops[i].codeSize);
+  FREE_ARRAY(vm, MEM_JIT, HotLoop, chunk->hotLoops, chunk->hotLoopCapacity);
+}
+
+void freeRecording(VM *vm) {
+  if (vm->recording != NULL)
+    FREE(vm, MEM_JIT, Recording, vm->recording);
+  vm->recording = NULL;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// A tracing JIT for hot loops, for x86-64. Unlike the baseline JIT (see jit.h),
+// it works alongside the interpreter instead of replacing it:
+//
+// 1. run() counts how often each OP_LOOP jumps back to a loop header. Once a
+//    header has been reached HOT_LOOP_THRESHOLD times, the interpreter records
+//    the next iteration: every instruction it runs on the way back to the
+//    header, together with the types of the values it sees.
+// 2. The recording is compiled to a straight line of machine code that jumps
+//    back to its own start. Every assumption the recording made (that a value
+//    is a number, which way a branch went) becomes a guard, which leaves the
+//    trace for the interpreter if it doesn't hold.
+// 3. From then on, reaching the header runs the trace instead, until a guard
+//    fails.
+//
+// Traces only handle numbers. The locals they use are unboxed into xmm
+// registers when the trace is entered and stay there across iterations, and
+// temporaries never touch vm->stack at all. A side exit writes everything back
+// as boxed values and sets vm->ip to the instruction to resume at, so the
+// interpreter carries on as if it had run those iterations itself. A recording
+// with anything else in it (strings, other loops, a loop too long or with too
+// many values live) isn't compiled, and after a few failed attempts the loop
+// is left to the interpreter for good.
+
+#define HOT_LOOP_THRESHOLD 64
+#define HOT_LOOP_MAX_ATTEMPTS 2
+#define TRACE_MAX_STEPS 256
+
+// Per loop header, kept in the chunk in header order.
+typedef struct HotLoop {
+  unsigned header;
+  unsigned hits;
+  unsigned attempts;
+  // How deep the stack is at the header, which the trace's code relies on.
+  unsigned stackDepth;
+  void *code;
+  size_t codeSize;
+} HotLoop;
+
+typedef enum {
+  TRACE_NUMBER,
+  TRACE_BOOL,
+  TRACE_OTHER,
+} TraceType;
+
+// A recorded instruction, and the types of the variables it read: the one read
+// by OP_GET_LOCAL or OP_GET_GLOBAL, or both of OP_ADD_LOCALS's. The types of
+// everything else follow from those and the constants.
+typedef struct {
+  unsigned offset;
+  TraceType types[2];
+} TraceStep;
+
+// The iteration being recorded. Only one loop is recorded at a time.
+typedef struct Recording {
+  unsigned header;
+  unsigned stackDepth;
+  unsigned count;
+  TraceStep steps[TRACE_MAX_STEPS];
+} Recording;
+
+typedef enum {
+  LOOP_INTERPRET,
+  LOOP_RECORD,
+} LoopAction;
+
+// Called by run() after OP_LOOP has jumped back to vm->ip. Runs the loop's
+// trace if it has one, which leaves vm->ip and vm->stackTop wherever the trace
+// exited. A trace whose entry guards fail returns without changing anything.
+// Returns LOOP_RECORD if the loop just got hot, in which case the caller should
+// record the next iteration with recordInstruction.
+LoopAction loopBackEdge(VM *vm);
+// Called before each instruction while recording. Returns false once the
+// recording is finished (after trying to compile it) or given up on, after
+// which the caller should go back to interpreting normally.
+bool recordInstruction(VM *vm);
+
+void freeHotLoops(VM *vm, Chunk *chunk);
+void freeRecording(VM *vm);
@@ -12,41 +12,45 @@ void initValueArray(ValueArray *array) {
   array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value) {
+void writeValueArray(VM *vm, MemoryCategory category, ValueArray *array,
+                     Value value) {
   if (array->capacity < array->count + 1) {
     unsigned oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values =
-        GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    array->values = GROW_ARRAY(vm, category, Value, array->values, oldCapacity,
+                               array->capacity);
   }
 
   array->values[array->count] = value;
   ++array->count;
 }
 
-void freeValueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM *vm, MemoryCategory category, ValueArray *array) {
+  FREE_ARRAY(vm, category, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
-void printValue(Value value) {
-  switch (value.type) {
-  case VAL_BOOL:
-    printf(asBool(value) ? "true" : "false");
-    break;
-  case VAL_NIL:
-    printf("nil");
-    break;
-  case VAL_NUMBER:
-    printf("%g", asNumber(value));
-    break;
-  case VAL_OBJ:
-    printObject(value);
-    break;
-  }
+void printValue(VM *vm, FILE *file, Value value) {
+  if (isBool(value))
+    fputs(asBool(value) ? "true" : "false", file);
+  else if (isNil(value))
+    fputs("nil", file);
+  else if (isNumber(value))
+    fprintf(file, "%g", asNumber(value));
+  else
+    printObject(vm, file, value);
 }
 
-bool valuesEqual(Value a, Value b) {
+bool valuesEqual(VM *vm, Value a, Value b) {
+#ifdef NAN_BOXING
+  // Numbers still need a floating-point comparison (NaN != NaN, 0 == -0), but
+  // everything else is equal exactly when its bits are.
+  if (isNumber(a) && isNumber(b))
+    return asNumber(a) == asNumber(b);
+  if (a != b && isObj(a) && isObj(b))
+    return objectsEqual(vm, asObj(a), asObj(b));
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
 
@@ -58,6 +62,9 @@ bool valuesEqual(Value a, Value b) {
   case VAL_NUMBER:
     return asNumber(a) == asNumber(b);
   case VAL_OBJ:
-    return asObj(a) == asObj(b);
+    return objectsEqual(vm, asObj(a), asObj(b));
+  case VAL_UNDEFINED:
+    return true;
   }
+#endif
 }
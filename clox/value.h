@@ -1,17 +1,52 @@
 #pragma once
 
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "common.h"
+#include "memstats.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
+
+#ifdef NAN_BOXING
+
+// NaN boxing packs every value into a single 64-bit word. Doubles are stored
+// as-is; everything else lives in the payload of a quiet NaN. Objects set the
+// sign bit and store their pointer in the low 48 bits, and the singleton values
+// use small tags in the low bits. The extra quiet bit (bit 50) keeps us clear of
+// the "real" NaN that x86 produces for things like 0/0. See
+// https://craftinginterpreters.com/optimization.html#nan-boxing for the gory
+// details.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+// Internal marker for global variable slots that haven't been defined yet. It
+// never ends up on the stack.
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define NIL_VAL ((Value)(QNAN | TAG_NIL))
+#define FALSE_VAL ((Value)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL ((Value)(QNAN | TAG_UNDEFINED))
+
+#else
 
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  // Internal marker for global variable slots that haven't been defined yet.
+  // It never ends up on the stack.
+  VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -23,6 +58,8 @@ typedef struct {
   } as;
 } Value;
 
+#endif
+
 // I'm using inline functions instead of macros because we may as well. I'm
 // marking them always_inline because -O0 wouldn't inline otherwise. C99 inline
 // semantics (as opposed to the C++ or gnu89 ones) are that a definition is
@@ -31,6 +68,47 @@ typedef struct {
 // the irony of using a macro for the attribute.
 #define ALWAYS_INLINE __attribute__((__always_inline__)) inline
 
+#ifdef NAN_BOXING
+
+// The bit-twiddling versions of the functions below. memcpy is the blessed way
+// to type-pun, and compiles down to a plain register move.
+ALWAYS_INLINE bool isBool(Value value) { return (value | 1) == TRUE_VAL; }
+ALWAYS_INLINE bool isNil(Value value) { return value == NIL_VAL; }
+ALWAYS_INLINE bool isUndefined(Value value) { return value == UNDEFINED_VAL; }
+ALWAYS_INLINE bool isNumber(Value value) { return (value & QNAN) != QNAN; }
+ALWAYS_INLINE bool isObj(Value value) {
+  return (value & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+ALWAYS_INLINE bool asBool(Value value) {
+  assert(isBool(value) && "Called asBool on non-bool");
+  return value == TRUE_VAL;
+}
+ALWAYS_INLINE double asNumber(Value value) {
+  assert(isNumber(value) && "Called asNumber on non-number");
+  double number;
+  memcpy(&number, &value, sizeof(value));
+  return number;
+}
+ALWAYS_INLINE Obj *asObj(Value value) {
+  assert(isObj(value) && "Called asObj on non-Obj");
+  return (Obj *)(uintptr_t)(value & ~(SIGN_BIT | QNAN));
+}
+
+ALWAYS_INLINE Value boolVal(bool value) { return value ? TRUE_VAL : FALSE_VAL; }
+ALWAYS_INLINE Value nilVal() { return NIL_VAL; }
+ALWAYS_INLINE Value undefinedVal() { return UNDEFINED_VAL; }
+ALWAYS_INLINE Value numberVal(double value) {
+  Value bits;
+  memcpy(&bits, &value, sizeof(value));
+  return bits;
+}
+ALWAYS_INLINE Value objVal(Obj *obj) {
+  return (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)obj);
+}
+
+#else
+
 // Taking values by pointer might be better, but that complicates other places,
 // and post-inlining optimizations should turn this into a direct field access:
 // https://godbolt.org/z/WKcb17hGc
@@ -38,6 +116,9 @@ ALWAYS_INLINE bool isBool(Value value) { return value.type == VAL_BOOL; }
 ALWAYS_INLINE bool isNil(Value value) { return value.type == VAL_NIL; }
 ALWAYS_INLINE bool isNumber(Value value) { return value.type == VAL_NUMBER; }
 ALWAYS_INLINE bool isObj(Value value) { return value.type == VAL_OBJ; }
+ALWAYS_INLINE bool isUndefined(Value value) {
+  return value.type == VAL_UNDEFINED;
+}
 
 ALWAYS_INLINE bool asBool(Value value) {
   assert(isBool(value) && "Called asBool on non-bool");
@@ -60,6 +141,16 @@ ALWAYS_INLINE Value numberVal(double value) {
   return (Value){VAL_NUMBER, {.number = value}};
 }
 ALWAYS_INLINE Value objVal(Obj *obj) { return (Value){VAL_OBJ, {.obj = obj}}; }
+ALWAYS_INLINE Value undefinedVal() {
+  return (Value){VAL_UNDEFINED, {.number = 0}};
+}
+
+#endif
+
+// Shared between the VM and the compiler's constant folding.
+ALWAYS_INLINE bool isFalsey(Value value) {
+  return isNil(value) || (isBool(value) && !asBool(value));
+}
 
 #undef ALWAYS_INLINE
 
@@ -71,8 +162,11 @@ typedef struct {
   Value *values;
 } ValueArray;
 
-bool valuesEqual(Value a, Value b);
+// Comparing or printing a rope flattens it (see object.h), which allocates.
+bool valuesEqual(VM *vm, Value a, Value b);
 void initValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
-void freeValueArray(ValueArray *array);
-void printValue(Value value);
+// `category` says what the array holds (see memstats.h).
+void writeValueArray(VM *vm, MemoryCategory category, ValueArray *array,
+                     Value value);
+void freeValueArray(VM *vm, MemoryCategory category, ValueArray *array);
+void printValue(VM *vm, FILE *file, Value value);
@@ -1,231 +1,332 @@
 #include "vm.h"
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "cache.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "tracejit.h"
 
-VM vm;
+static void resetStack(VM *vm) { vm->stackTop = vm->stack; }
 
-static void resetStack() { vm.stackTop = vm.stack; }
-
-__attribute__((format(printf, 1, 2))) static void
-runtimeError(const char *format, ...) {
+__attribute__((format(printf, 2, 3))) static void
+runtimeError(VM *vm, const char *format, ...) {
   va_list(args);
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm->err, format, args);
   va_end(args);
 
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  unsigned line = vm.chunk->lines[instruction];
-  fprintf(stderr, "\n[line %d] in script\n", line);
-  resetStack();
+  size_t instruction = vm->ip - vm->chunk->code - 1;
+  unsigned line = getLine(vm->chunk, (unsigned)instruction);
+  fprintf(vm->err, "\n[line %d] in script\n", line);
+  resetStack(vm);
 }
 
-void initVM() {
-  resetStack();
-  vm.objects = NULL;
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+void initVM(VM *vm) {
+  resetStack(vm);
+  vm->chunk = NULL;
+  vm->ip = NULL;
+  vm->tracer = NULL;
+  vm->profiler = NULL;
+  vm->jit = false;
+  vm->traceJit = false;
+  vm->recording = NULL;
+  vm->compilingChunk = NULL;
+  vm->scripts = NULL;
+  vm->out = stdout;
+  vm->err = stderr;
+  initHeap(vm);
+
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalValues);
+  initValueArray(&vm->globalNames);
+  initTable(&vm->strings);
 }
 
-void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  freeObjects();
+void freeVM(VM *vm) {
+  while (vm->scripts != NULL)
+    freeScript(vm, vm->scripts);
+  freeTable(vm, &vm->globalSlots);
+  freeValueArray(vm, MEM_GLOBALS, &vm->globalValues);
+  freeValueArray(vm, MEM_GLOBALS, &vm->globalNames);
+  freeTable(vm, &vm->strings);
+  freeRecording(vm);
+  freeObjects(vm);
 }
 
-void push(Value value) { *vm.stackTop++ = value; }
+unsigned resolveGlobal(VM *vm, ObjString *name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot))
+    return (unsigned)asNumber(slot);
+
+  unsigned newSlot = vm->globalValues.count;
+  writeValueArray(vm, MEM_GLOBALS, &vm->globalValues, undefinedVal());
+  writeValueArray(vm, MEM_GLOBALS, &vm->globalNames, OBJ_VAL(name));
+  globalWriteBarrier(vm, newSlot, OBJ_VAL(name));
+  tableSet(vm, &vm->globalSlots, name, numberVal(newSlot));
+  return newSlot;
+}
 
-Value pop() { return *--vm.stackTop; }
+void push(VM *vm, Value value) { *vm->stackTop++ = value; }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+Value pop(VM *vm) { return *--vm->stackTop; }
 
-static bool isFalsey(Value value) {
-  return isNil(value) || (isBool(value) && !asBool(value));
+static Value peek(VM *vm, int distance) {
+  return vm->stackTop[-1 - distance];
 }
 
-static void concatenate() {
-  ObjString *b = asString(pop());
-  ObjString *a = asString(pop());
-  ObjString *result = concatenateStrings(a, b);
-  push(OBJ_VAL(result));
+static void concatenate(VM *vm) {
+  Value b = pop(vm);
+  Value a = pop(vm);
+  push(vm, addStrings(vm, a, b));
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() asString(READ_CONSTANT())
+// Shared by OP_ADD's superinstructions, which have their operands in hand
+// instead of on the stack.
+static bool add(VM *vm, Value a, Value b) {
+  if (isNumber(a) && isNumber(b)) {
+    push(vm, numberVal(asNumber(a) + asNumber(b)));
+  } else if (isString(a) && isString(b)) {
+    push(vm, a);
+    push(vm, b);
+    concatenate(vm);
+  } else {
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
+  }
+  return true;
+}
 
-#define BINARY_OP_WITH_ERROR(valueType, op, typeErrorMessage)                  \
-  do {                                                                         \
-    if (!isNumber(peek(0)) || !isNumber(peek(1))) {                            \
-      runtimeError(typeErrorMessage);                                          \
-      return INTERPRET_RUNTIME_ERROR;                                          \
-    }                                                                          \
-    double b = asNumber(pop());                                                \
-    double a = asNumber(pop());                                                \
-    push(valueType(a op b));                                                   \
-  } while (false)
+// The comparison superinstructions stand in for a comparison followed by
+// OP_NOT, so `a >= b` must stay !(a < b) to get the same answer for NaN.
+static Value notBoolVal(bool value) { return boolVal(!value); }
+
+// run() and runRecording() hand over to each other by returning one of these
+// to runInterpreted(), rather than by calling each other, which would leave two
+// more frames on the C stack for every loop recorded.
+#define RUN_START_RECORDING ((InterpretResult)(INTERPRET_RUNTIME_ERROR + 1))
+#define RUN_STOP_RECORDING ((InterpretResult)(INTERPRET_RUNTIME_ERROR + 2))
+
+// See run.h for why there are several of these.
+#define RUN run
+#define BEFORE_INSTRUCTION() ((void)0)
+#define AFTER_LOOP()                                                           \
+  if (vm->traceJit && loopBackEdge(vm) == LOOP_RECORD)                         \
+  return RUN_START_RECORDING
+#include "run.h"
+#undef RUN
+#undef BEFORE_INSTRUCTION
+#undef AFTER_LOOP
+
+// Records one iteration of a hot loop (see tracejit.h) and then goes back to
+// run(), which picks up wherever the recording left off.
+#define RUN runRecording
+#define BEFORE_INSTRUCTION()                                                   \
+  if (!recordInstruction(vm))                                                  \
+  return RUN_STOP_RECORDING
+#define AFTER_LOOP() ((void)0)
+#include "run.h"
+#undef RUN
+#undef BEFORE_INSTRUCTION
+#undef AFTER_LOOP
+
+static InterpretResult runInterpreted(VM *vm) {
+  InterpretResult result = run(vm);
+  while (result == RUN_START_RECORDING) {
+    result = runRecording(vm);
+    if (result == RUN_STOP_RECORDING)
+      result = run(vm);
+  }
+  return result;
+}
 
-#define BINARY_OP(valueType, op)                                               \
-  BINARY_OP_WITH_ERROR(valueType, op, "Operands must be numbers.")
+#define RUN runTraced
+#define BEFORE_INSTRUCTION()                                                   \
+  traceInstruction(vm->tracer, (uint32_t)(vm->ip - vm->chunk->code), *vm->ip,  \
+                   (uint16_t)(vm->stackTop - vm->stack))
+#define AFTER_LOOP() ((void)0)
+#include "run.h"
+#undef RUN
+#undef BEFORE_INSTRUCTION
+#undef AFTER_LOOP
+
+#define RUN runProfiled
+#define BEFORE_INSTRUCTION() profileInstruction(vm->profiler, *vm->ip)
+#define AFTER_LOOP() ((void)0)
+#include "run.h"
+#undef RUN
+#undef BEFORE_INSTRUCTION
+#undef AFTER_LOOP
+
+// The JIT's out-of-line instructions (see jit.h). Each does what the
+// instruction does in run.h, with its operands as arguments.
+bool jitAdd(VM *vm) {
+  Value b = pop(vm);
+  Value a = pop(vm);
+  return add(vm, a, b);
+}
 
-  while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    putchar('\n');
-    disassembleInstruction(vm.chunk, (unsigned)(vm.ip - vm.chunk->code));
-#endif
+void jitEqual(VM *vm) {
+  Value a = pop(vm);
+  Value b = pop(vm);
+  push(vm, boolVal(valuesEqual(vm, a, b)));
+}
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
-    }
+void jitNotEqual(VM *vm) {
+  Value a = pop(vm);
+  Value b = pop(vm);
+  push(vm, boolVal(!valuesEqual(vm, a, b)));
+}
 
-    case OP_NIL:
-      push(nilVal());
-      break;
-    case OP_TRUE:
-      push(boolVal(true));
-      break;
-    case OP_FALSE:
-      push(boolVal(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(vm.stack[slot]);
-      break;
-    }
+void jitNot(VM *vm) { push(vm, boolVal(isFalsey(pop(vm)))); }
 
-    case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      vm.stack[slot] = peek(0);
-      break;
-    }
+void jitPrint(VM *vm) {
+  printValue(vm, vm->out, pop(vm));
+  fputc('\n', vm->out);
+}
 
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
-    }
+void jitDefineGlobal(VM *vm, unsigned slot) {
+  Value value = pop(vm);
+  globalWriteBarrier(vm, slot, value);
+  vm->globalValues.values[slot] = value;
+}
 
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
-    }
+bool jitSetGlobal(VM *vm, unsigned slot) {
+  if (isUndefined(vm->globalValues.values[slot])) {
+    jitUndefinedVariable(vm, slot);
+    return false;
+  }
+  globalWriteBarrier(vm, slot, peek(vm, 0));
+  vm->globalValues.values[slot] = peek(vm, 0);
+  return true;
+}
 
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
+void jitUndefinedVariable(VM *vm, unsigned slot) {
+  runtimeError(vm, "Undefined variable '%s'.",
+               asString(vm->globalNames.values[slot])->chars);
+}
 
-    case OP_EQUAL: {
-      Value a = pop();
-      Value b = pop();
-      push(boolVal(valuesEqual(a, b)));
-      break;
-    }
+void jitRuntimeError(VM *vm, const char *message) {
+  runtimeError(vm, "%s", message);
+}
 
-    case OP_GREATER:
-      BINARY_OP(boolVal, >);
-      break;
-
-    case OP_LESS:
-      BINARY_OP(boolVal, <);
-      break;
-
-    case OP_ADD:
-      if (isString(peek(0)) && isString(peek(1)))
-        concatenate();
-      else
-        BINARY_OP_WITH_ERROR(numberVal, +,
-                             "Operands must be two numbers or two strings.");
-      break;
-
-    case OP_SUBTRACT:
-      BINARY_OP(numberVal, -);
-      break;
-
-    case OP_MULTIPLY:
-      BINARY_OP(numberVal, *);
-      break;
-
-    case OP_DIVIDE:
-      BINARY_OP(numberVal, /);
-      break;
-
-    case OP_NOT:
-      push(boolVal(isFalsey(pop())));
-      break;
-
-    case OP_NEGATE:
-      if (!isNumber(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(numberVal(-asNumber(pop())));
-      break;
-
-    case OP_PRINT: {
-      printValue(pop());
-      putchar('\n');
-      break;
-    }
+static InterpretResult runChunk(VM *vm, Chunk *chunk) {
+  // The sampler (see sampler.h) can interrupt at any point, so it mustn't see
+  // the new chunk before ip points into it.
+  vm->ip = chunk->code;
+  atomic_signal_fence(memory_order_release);
+  vm->chunk = chunk;
+
+  InterpretResult result;
+  if (vm->tracer != NULL) {
+    result = runTraced(vm);
+  } else if (vm->profiler != NULL) {
+    beginProfiledRun(vm->profiler);
+    result = runProfiled(vm);
+    endProfiledRun(vm->profiler);
+  } else if (vm->jit && compileJit(vm, chunk)) {
+    result = runJit(vm, chunk);
+  } else {
+    result = runInterpreted(vm);
+  }
 
-    case OP_RETURN:
-      // Exit interpreter.
-      return INTERPRET_OK;
-    }
+  vm->chunk = NULL;
+  return result;
+}
+
+Script *newScript(VM *vm) {
+  Script *script = ALLOCATE(vm, MEM_SCRIPTS, Script, 1);
+  initChunk(&script->chunk);
+  script->previous = NULL;
+  script->next = vm->scripts;
+  if (vm->scripts != NULL)
+    vm->scripts->previous = script;
+  vm->scripts = script;
+  return script;
+}
+
+Script *compileScript(VM *vm, const char *source) {
+  Script *script = newScript(vm);
+  if (!compile(vm, source, &script->chunk)) {
+    freeScript(vm, script);
+    return NULL;
   }
+  return script;
+}
 
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
+InterpretResult runScript(VM *vm, Script *script) {
+  return runChunk(vm, &script->chunk);
 }
 
-InterpretResult interpret(const char *source) {
-  Chunk chunk;
-  initChunk(&chunk);
+void freeScript(VM *vm, Script *script) {
+  if (script->previous != NULL)
+    script->previous->next = script->next;
+  else
+    vm->scripts = script->next;
+  if (script->next != NULL)
+    script->next->previous = script->previous;
+
+  freeChunk(vm, &script->chunk);
+  FREE(vm, MEM_SCRIPTS, Script, script);
+}
+
+void resetGlobals(VM *vm) {
+  for (unsigned i = 0; i < vm->globalValues.count; ++i)
+    vm->globalValues.values[i] = undefinedVal();
+}
 
-  if (!compile(source, &chunk)) {
-    freeChunk(&chunk);
+void defineGlobal(VM *vm, const char *name, Value value) {
+  // Interning the name can trigger a collection, which may move the value.
+  push(vm, value);
+  unsigned slot =
+      resolveGlobal(vm, copyString(vm, name, (unsigned)strlen(name)));
+  value = pop(vm);
+
+  globalWriteBarrier(vm, slot, value);
+  vm->globalValues.values[slot] = value;
+}
+
+InterpretResult interpret(VM *vm, const char *source) {
+  Script *script = compileScript(vm, source);
+  if (script == NULL)
     return INTERPRET_COMPILE_ERROR;
-  }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+  InterpretResult result = runScript(vm, script);
+  freeScript(vm, script);
+  return result;
+}
 
-  InterpretResult result = run();
+InterpretResult interpretCached(VM *vm, const char *source,
+                                const char *cachePath) {
+  Chunk chunk;
+  initChunk(&chunk);
+
+  // The cache's strings are allocated straight into the chunk, so it has to be
+  // a root while it loads. It isn't vm->chunk yet, since the sampler would see
+  // it half loaded.
+  vm->compilingChunk = &chunk;
+  bool cached = loadCachedChunk(vm, cachePath, source, &chunk);
+  vm->compilingChunk = NULL;
+
+  if (cached) {
+#ifdef DEBUG_PRINT_CODE
+    disassembleChunk(vm, &chunk, "code");
+#endif
+  } else {
+    if (!compile(vm, source, &chunk)) {
+      freeChunk(vm, &chunk);
+      return INTERPRET_COMPILE_ERROR;
+    }
+    writeCachedChunk(vm, cachePath, source, &chunk);
+  }
 
-  freeChunk(&chunk);
+  InterpretResult result = runChunk(vm, &chunk);
+  freeChunk(vm, &chunk);
   return result;
 }
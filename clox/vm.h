@@ -1,21 +1,105 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "chunk.h"
 #include "common.h"
+#include "memstats.h"
+#include "profile.h"
+#include "slab.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
 #define STACK_MAX 256
 
 typedef struct {
+  Table *table;
+  ObjString *key;
+} RememberedKey;
+
+// A compiled script, which can be run any number of times in the VM that
+// compiled it. Its code refers to that VM's global slots and strings, so it
+// can't be run in any other VM.
+typedef struct Script {
+  Chunk chunk;
+  struct Script *previous;
+  struct Script *next;
+} Script;
+
+// Everything an interpreter instance owns. Nothing is shared between VMs, so
+// separate VMs can run on separate threads.
+struct VM {
   Chunk *chunk;
   uint8_t *ip;
   Value stack[STACK_MAX];
   Value *stackTop;
-  Table globals;
+  // Set to record a trace of the instructions run (see trace.h) or to profile
+  // them (see profile.h). Tracing wins if both are set.
+  Tracer *tracer;
+  Profiler *profiler;
+  // Whether to run scripts as machine code (see jit.h). The tracer and the
+  // profiler need the interpreter, so they win over the JIT.
+  bool jit;
+  // Whether the interpreter compiles hot loops (see tracejit.h), and the loop
+  // iteration it's recording, if any. Only run() does this, so the JIT, the
+  // tracer and the profiler all win over it.
+  bool traceJit;
+  struct Recording *recording;
+  // The chunk being compiled or loaded from a cache, if any, and every script
+  // that's been compiled and not freed yet. Their constants are roots.
+  Chunk *compilingChunk;
+  Script *scripts;
+  // Where the script's output and error messages go. stdout and stderr by
+  // default.
+  FILE *out;
+  FILE *err;
+  // Global variables live in a dense array, and instructions refer to them by
+  // index. The compiler maps each name to its slot through globalSlots the
+  // first time it sees it, so a name keeps its slot across REPL lines. Slots
+  // hold the undefined value until the variable is defined.
+  Table globalSlots;
+  ValueArray globalValues;
+  ValueArray globalNames;
+  // Weak: the collector drops strings that nothing else refers to.
   Table strings;
   Obj *objects;
-} VM;
+
+  // Garbage collector state. A full collection runs once bytesAllocated
+  // (which counts every live allocation made through reallocate or the slabs,
+  // so not the nursery) reaches nextGC.
+  Slabs slabs;
+  size_t bytesAllocated;
+  // What everything the VM allocated was for (see memstats.h).
+  MemoryStats memory;
+  size_t nextGC;
+  unsigned grayCount;
+  unsigned grayCapacity;
+  Obj **grayStack;
+
+  // The nursery, and the old-to-young references recorded by the write
+  // barriers since the last minor collection. isGlobalRemembered keeps a slot
+  // from being recorded twice.
+  uint8_t *nurseryStart;
+  uint8_t *nurseryTop;
+  uint8_t *nurseryEnd;
+  unsigned *rememberedGlobals;
+  unsigned rememberedGlobalCount;
+  unsigned rememberedGlobalCapacity;
+  bool *isGlobalRemembered;
+  unsigned isGlobalRememberedCapacity;
+  RememberedKey *rememberedKeys;
+  unsigned rememberedKeyCount;
+  unsigned rememberedKeyCapacity;
+  // The ropes in the nursery. Once flattened, a rope owns a buffer of its
+  // characters (see object.h), which has to be freed if it dies young.
+  // youngRopeBytes is how big those buffers are, which counts towards filling
+  // up the nursery.
+  Obj **youngRopes;
+  unsigned youngRopeCount;
+  unsigned youngRopeCapacity;
+  size_t youngRopeBytes;
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -23,10 +107,28 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM *vm);
+void freeVM(VM *vm);
+InterpretResult interpret(VM *vm, const char *source);
+// Like interpret, but reuses the compiled chunk cached at `cachePath` if it's
+// still valid for `source`, and caches the chunk there otherwise.
+InterpretResult interpretCached(VM *vm, const char *source,
+                                const char *cachePath);
+unsigned resolveGlobal(VM *vm, ObjString *name);
 
-void initVM(void);
-void freeVM(void);
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop(void);
+// Compiling once and running many times. compileScript returns NULL if the
+// source doesn't compile. Running a script again starts over with the globals
+// as the previous run left them, unless they're reset in between.
+Script *compileScript(VM *vm, const char *source);
+// An empty script, for hosts that fill in its chunk themselves (see aot.h).
+Script *newScript(VM *vm);
+InterpretResult runScript(VM *vm, Script *script);
+void freeScript(VM *vm, Script *script);
+// Makes every global undefined again, including ones the host defined.
+void resetGlobals(VM *vm);
+// Defines (or redefines) the global `name` as `value`. A string value must come
+// straight from copyString, with nothing allocated in between, since
+// allocating can move it.
+void defineGlobal(VM *vm, const char *name, Value value);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
@@ -0,0 +1,270 @@
+// MAP_ANONYMOUS isn't in POSIX 2008, so ask for glibc's default extensions.
+#define _DEFAULT_SOURCE
+
+#include "x64.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+void initAssembler(Assembler *as, VM *vm) {
+  as->vm = vm;
+  as->code = NULL;
+  as->count = 0;
+  as->capacity = 0;
+}
+
+void freeAssembler(Assembler *as) {
+  FREE_ARRAY(as->vm, MEM_JIT, uint8_t, as->code, as->capacity);
+  initAssembler(as, as->vm);
+}
+
+void emitByte(Assembler *as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    unsigned oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(as->vm, MEM_JIT, uint8_t, as->code, oldCapacity,
+                          as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+void emitBytes(Assembler *as, const uint8_t *bytes, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    emitByte(as, bytes[i]);
+}
+
+void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+void emitModRM(Assembler *as, unsigned reg, Register base, int32_t disp) {
+  emitByte(as, (uint8_t)(0x80 | (reg & 7) << 3 | base));
+  // An rsp base means a SIB byte follows, which is [rsp] with no index.
+  if (base == RSP)
+    emitByte(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+void emitLoad(Assembler *as, Register reg, Register base, int32_t disp) {
+  EMIT(as, REX_W, 0x8b);
+  emitModRM(as, reg, base, disp);
+}
+
+void emitStore(Assembler *as, Register base, int32_t disp, Register reg) {
+  EMIT(as, REX_W, 0x89);
+  emitModRM(as, reg, base, disp);
+}
+
+void emitLoadImmediate(Assembler *as, Register reg, uint64_t value) {
+  EMIT(as, REX_W, 0xb8 + reg);
+  emit64(as, value);
+}
+
+void emitLoadImmediate32(Assembler *as, Register reg, uint32_t value) {
+  emitByte(as, 0xb8 + reg);
+  emit32(as, value);
+}
+
+void emitMove(Assembler *as, Register to, Register from) {
+  EMIT(as, REX_W, 0x89, 0xc0 | from << 3 | to);
+}
+
+void emitAddImmediate(Assembler *as, Register reg, int32_t value) {
+  EMIT(as, REX_W, 0x81, 0xc0 | reg);
+  emit32(as, (uint32_t)value);
+}
+
+void emitSetcc(Assembler *as, Condition condition) {
+  EMIT(as, 0x0f, 0x90 + condition, 0xc0);
+}
+
+unsigned emitJump(Assembler *as, Condition condition) {
+  if (condition == ALWAYS)
+    emitByte(as, 0xe9);
+  else
+    EMIT(as, 0x0f, 0x80 + condition);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+void patchJump(Assembler *as, unsigned at) { patchJumpTo(as, at, as->count); }
+
+void patchJumpTo(Assembler *as, unsigned at, unsigned target) {
+  int32_t distance = (int32_t)target - (int32_t)(at + 4);
+  memcpy(&as->code[at], &distance, sizeof(distance));
+}
+
+// The REX prefix an SSE instruction needs for xmm8-15, if any. It goes after
+// the mandatory prefix.
+static void emitSseRex(Assembler *as, unsigned reg, unsigned rm) {
+  if (reg >= 8 || rm >= 8)
+    emitByte(as, 0x40 | (reg >= 8) << 2 | (rm >= 8));
+}
+
+void emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, unsigned xmm,
+             Register base, int32_t disp) {
+  emitByte(as, prefix);
+  emitSseRex(as, xmm, 0);
+  EMIT(as, 0x0f, opcode);
+  emitModRM(as, xmm, base, disp);
+}
+
+void emitSseRegisters(Assembler *as, uint8_t prefix, uint8_t opcode,
+                      unsigned xmm, unsigned otherXmm) {
+  emitByte(as, prefix);
+  emitSseRex(as, xmm, otherXmm);
+  EMIT(as, 0x0f, opcode, 0xc0 | (xmm & 7) << 3 | (otherXmm & 7));
+}
+
+void emitMovqToXmm(Assembler *as, unsigned xmm, Register reg) {
+  EMIT(as, 0x66, REX_W | (xmm >= 8) << 2, 0x0f, 0x6e,
+       0xc0 | (xmm & 7) << 3 | reg);
+}
+
+void emitMovqFromXmm(Assembler *as, Register reg, unsigned xmm) {
+  EMIT(as, 0x66, REX_W | (xmm >= 8) << 2, 0x0f, 0x7e,
+       0xc0 | (xmm & 7) << 3 | reg);
+}
+
+#ifdef NAN_BOXING
+
+unsigned emitJumpUnlessNumber(Assembler *as, Register base, int32_t disp) {
+  // Anything with all of the quiet NaN bits set isn't a number.
+  emitLoad(as, RDX, base, disp);
+  emitLoadImmediate(as, RAX, QNAN);
+  // and rdx, rax; cmp rdx, rax
+  EMIT(as, REX_W, 0x21, 0xc2, REX_W, 0x39, 0xc2);
+  return emitJump(as, EQUAL);
+}
+
+unsigned emitJumpIfUndefined(Assembler *as, Register base, int32_t disp) {
+  emitLoadImmediate(as, RDX, UNDEFINED_VAL);
+  // cmp [base + disp], rdx
+  EMIT(as, REX_W, 0x39);
+  emitModRM(as, RDX, base, disp);
+  return emitJump(as, EQUAL);
+}
+
+unsigned emitJumpIfFalsey(Assembler *as, Register base, int32_t disp,
+                          unsigned jumps[2]) {
+  // FALSE_VAL is NIL_VAL + 1, and nothing else is within 1 of NIL_VAL, so
+  // value - NIL_VAL <= 1 (unsigned) exactly when the value is falsey.
+  emitLoad(as, RDX, base, disp);
+  emitLoadImmediate(as, RAX, NIL_VAL);
+  // sub rdx, rax; cmp rdx, 1
+  EMIT(as, REX_W, 0x29, 0xc2, REX_W, 0x83, 0xfa, 0x01);
+  jumps[0] = emitJump(as, BELOW_OR_EQUAL);
+  return 1;
+}
+
+void emitStoreBool(Assembler *as, Register base, int32_t disp) {
+  // TRUE_VAL is FALSE_VAL | 1, so movzx eax, al; or rax, rdx.
+  EMIT(as, 0x0f, 0xb6, 0xc0);
+  emitLoadImmediate(as, RDX, FALSE_VAL);
+  EMIT(as, REX_W, 0x09, 0xd0);
+  emitStore(as, base, disp, RAX);
+}
+
+void emitStoreNumber(Assembler *as, Register base, int32_t disp,
+                     unsigned xmm) {
+  emitSse(as, SD, MOVSD_STORE, xmm, base, disp);
+}
+
+#else
+
+unsigned emitJumpUnlessNumber(Assembler *as, Register base, int32_t disp) {
+  // cmp dword [base + disp], VAL_NUMBER
+  emitByte(as, 0x81);
+  emitModRM(as, 7, base, disp + (int32_t)offsetof(Value, type));
+  emit32(as, VAL_NUMBER);
+  return emitJump(as, NOT_EQUAL);
+}
+
+unsigned emitJumpIfUndefined(Assembler *as, Register base, int32_t disp) {
+  // cmp dword [base + disp], VAL_UNDEFINED
+  emitByte(as, 0x81);
+  emitModRM(as, 7, base, disp + (int32_t)offsetof(Value, type));
+  emit32(as, VAL_UNDEFINED);
+  return emitJump(as, EQUAL);
+}
+
+unsigned emitJumpIfFalsey(Assembler *as, Register base, int32_t disp,
+                          unsigned jumps[2]) {
+  int32_t type = disp + (int32_t)offsetof(Value, type);
+  // cmp dword [base + type], VAL_NIL
+  emitByte(as, 0x81);
+  emitModRM(as, 7, base, type);
+  emit32(as, VAL_NIL);
+  jumps[0] = emitJump(as, EQUAL);
+
+  // cmp dword [base + type], VAL_BOOL
+  emitByte(as, 0x81);
+  emitModRM(as, 7, base, type);
+  emit32(as, VAL_BOOL);
+  unsigned notBool = emitJump(as, NOT_EQUAL);
+  // cmp byte [base + boolean], 0
+  emitByte(as, 0x80);
+  emitModRM(as, 7, base, disp + (int32_t)offsetof(Value, as.boolean));
+  emitByte(as, 0);
+  jumps[1] = emitJump(as, EQUAL);
+  patchJump(as, notBool);
+  return 2;
+}
+
+void emitStoreBool(Assembler *as, Register base, int32_t disp) {
+  // mov dword [base + type], VAL_BOOL; mov [base + boolean], al
+  emitByte(as, 0xc7);
+  emitModRM(as, 0, base, disp + (int32_t)offsetof(Value, type));
+  emit32(as, VAL_BOOL);
+  emitByte(as, 0x88);
+  emitModRM(as, RAX, base, disp + (int32_t)offsetof(Value, as.boolean));
+}
+
+void emitStoreNumber(Assembler *as, Register base, int32_t disp,
+                     unsigned xmm) {
+  // mov dword [base + type], VAL_NUMBER
+  emitByte(as, 0xc7);
+  emitModRM(as, 0, base, disp + (int32_t)offsetof(Value, type));
+  emit32(as, VAL_NUMBER);
+  emitSse(as, SD, MOVSD_STORE, xmm, base, disp + PAYLOAD);
+}
+
+#endif
+
+void emitStoreValue(Assembler *as, Register base, int32_t disp, Value value) {
+  uint64_t words[sizeof(Value) / 8];
+  memcpy(words, &value, sizeof(value));
+  for (unsigned i = 0; i < sizeof(Value) / 8; ++i) {
+    emitLoadImmediate(as, RAX, words[i]);
+    emitStore(as, base, disp + 8 * (int32_t)i, RAX);
+  }
+}
+
+void *mapExecutable(Assembler *as) {
+  // Map the code writable to copy it in, and then executable instead, so that
+  // it's never both.
+  void *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+
+  memcpy(code, as->code, as->count);
+  if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, as->count);
+    return NULL;
+  }
+  return code;
+}
+
+void unmapExecutable(void *code, size_t size) {
+  if (code != NULL)
+    munmap(code, size);
+}
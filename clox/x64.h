@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+// A tiny x86-64 assembler shared by the JITs (see jit.h and tracejit.h). It
+// only knows the handful of instruction forms they need. Every memory operand
+// is [base + disp32], and only the first eight general purpose registers are
+// supported, so that nothing but SSE instructions ever needs a REX.R or REX.B.
+
+// General purpose registers, numbered the way x86 encodes them.
+typedef enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI } Register;
+
+// Condition codes, as used by jcc and setcc. ucomisd sets the flags like an
+// unsigned comparison, and unordered (NaN) operands set ZF, PF and CF.
+typedef enum {
+  ALWAYS = -1,
+  BELOW = 0x2,
+  ABOVE_OR_EQUAL = 0x3,
+  EQUAL = 0x4,
+  NOT_EQUAL = 0x5,
+  BELOW_OR_EQUAL = 0x6,
+  ABOVE = 0x7,
+  PARITY = 0xa,
+  NOT_PARITY = 0xb,
+} Condition;
+
+typedef struct {
+  VM *vm;
+  uint8_t *code;
+  unsigned count;
+  unsigned capacity;
+} Assembler;
+
+#define REX_W 0x48
+
+// The prefixes and opcodes (after 0F) of the SSE instructions the JITs use.
+// The scalar double ones share a prefix; ucomisd and movq have their own.
+#define SD 0xf2
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define PD 0x66
+#define UCOMISD 0x2e
+
+void initAssembler(Assembler *as, VM *vm);
+void freeAssembler(Assembler *as);
+
+void emitByte(Assembler *as, uint8_t byte);
+void emitBytes(Assembler *as, const uint8_t *bytes, size_t count);
+#define EMIT(as, ...)                                                          \
+  emitBytes(as, (const uint8_t[]){__VA_ARGS__},                                \
+            sizeof((const uint8_t[]){__VA_ARGS__}))
+void emit32(Assembler *as, uint32_t value);
+void emit64(Assembler *as, uint64_t value);
+// The ModRM byte (and SIB, for rsp) for [base + disp].
+void emitModRM(Assembler *as, unsigned reg, Register base, int32_t disp);
+
+// mov reg, [base + disp]
+void emitLoad(Assembler *as, Register reg, Register base, int32_t disp);
+// mov [base + disp], reg
+void emitStore(Assembler *as, Register base, int32_t disp, Register reg);
+// mov reg, imm64
+void emitLoadImmediate(Assembler *as, Register reg, uint64_t value);
+// mov reg32, imm32, which zero-extends.
+void emitLoadImmediate32(Assembler *as, Register reg, uint32_t value);
+// mov to, from
+void emitMove(Assembler *as, Register to, Register from);
+// add reg, imm32
+void emitAddImmediate(Assembler *as, Register reg, int32_t value);
+// setcc al
+void emitSetcc(Assembler *as, Condition condition);
+
+// Returns where the jump's rel32 is, to pass to patchJump.
+unsigned emitJump(Assembler *as, Condition condition);
+// Points the jump whose rel32 is at `at` to the next instruction emitted.
+void patchJump(Assembler *as, unsigned at);
+// Points the jump whose rel32 is at `at` to `target`.
+void patchJumpTo(Assembler *as, unsigned at, unsigned target);
+
+// An SSE instruction between xmm register `xmm` and [base + disp].
+void emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, unsigned xmm,
+             Register base, int32_t disp);
+// An SSE instruction between two xmm registers.
+void emitSseRegisters(Assembler *as, uint8_t prefix, uint8_t opcode,
+                      unsigned xmm, unsigned otherXmm);
+// movq xmm, reg and movq reg, xmm.
+void emitMovqToXmm(Assembler *as, unsigned xmm, Register reg);
+void emitMovqFromXmm(Assembler *as, Register reg, unsigned xmm);
+
+// Templates for values, which depend on how they're represented. Each works on
+// the value at [base + disp].
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define PAYLOAD ((int32_t)offsetof(Value, as))
+#endif
+// Clobber rax and rdx.
+unsigned emitJumpUnlessNumber(Assembler *as, Register base, int32_t disp);
+unsigned emitJumpIfUndefined(Assembler *as, Register base, int32_t disp);
+// Emits up to two jumps, returning how many, since a struct value needs one for
+// nil and one for false.
+unsigned emitJumpIfFalsey(Assembler *as, Register base, int32_t disp,
+                          unsigned jumps[2]);
+// Stores al as a bool. Clobbers rax and rdx.
+void emitStoreBool(Assembler *as, Register base, int32_t disp);
+// Stores xmm as a number.
+void emitStoreNumber(Assembler *as, Register base, int32_t disp, unsigned xmm);
+// Stores `value`. Clobbers rax.
+void emitStoreValue(Assembler *as, Register base, int32_t disp, Value value);
+
+// Copies the code into memory that's executable (and not writable). Returns
+// NULL if it can't be mapped.
+void *mapExecutable(Assembler *as);
+void unmapExecutable(void *code, size_t size);
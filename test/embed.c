@@ -0,0 +1,100 @@
+// Exercises the embedding API in clox.h: compiling once, running many times,
+// resetting globals, defining globals from the host and memory statistics.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,         \
+              #condition);                                                     \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (false)
+
+static char *output;
+static size_t outputLength;
+
+// Runs `script` with the VM's output going to a fresh buffer.
+static InterpretResult runCaptured(VM *vm, Script *script) {
+  free(output);
+  vm->out = open_memstream(&output, &outputLength);
+  InterpretResult result = runScript(vm, script);
+  fclose(vm->out);
+  vm->out = stdout;
+  return result;
+}
+
+int main(void) {
+  VM vm;
+  initVM(&vm);
+  FILE *errors = tmpfile();
+  vm.err = errors;
+
+  defineGlobal(&vm, "greeting", OBJ_VAL(copyString(&vm, "hello", 5)));
+  defineGlobal(&vm, "answer", numberVal(42));
+
+  Script *script = compileScript(&vm, "var count = answer;\n"
+                                      "print greeting + \" world\";\n"
+                                      "print count / 2;\n");
+  CHECK(script != NULL);
+
+  // The script's constants have to survive whatever runs in between.
+  Script *garbage = compileScript(&vm, "var s = \"a\";\n"
+                                       "s = s + s + s + s;\n"
+                                       "s = s + s + s + s;\n"
+                                       "s = s + s + s + s;\n");
+  CHECK(garbage != NULL);
+
+  for (int i = 0; i < 3; ++i) {
+    CHECK(runCaptured(&vm, script) == INTERPRET_OK);
+    CHECK(strcmp(output, "hello world\n21\n") == 0);
+    CHECK(runCaptured(&vm, garbage) == INTERPRET_OK);
+  }
+  freeScript(&vm, garbage);
+
+  // Globals persist between runs until they're reset.
+  Script *readCount = compileScript(&vm, "print count;\n");
+  CHECK(readCount != NULL);
+  CHECK(runCaptured(&vm, readCount) == INTERPRET_OK);
+  CHECK(strcmp(output, "42\n") == 0);
+
+  resetGlobals(&vm);
+  CHECK(runCaptured(&vm, readCount) == INTERPRET_RUNTIME_ERROR);
+  CHECK(runCaptured(&vm, script) == INTERPRET_RUNTIME_ERROR);
+
+  defineGlobal(&vm, "greeting", OBJ_VAL(copyString(&vm, "goodbye", 7)));
+  defineGlobal(&vm, "answer", numberVal(8));
+  CHECK(runCaptured(&vm, script) == INTERPRET_OK);
+  CHECK(strcmp(output, "goodbye world\n4\n") == 0);
+
+  CHECK(compileScript(&vm, "print ;") == NULL);
+
+  // The categories add up to the total, and freeing a script gives its code
+  // back.
+  const MemoryStats *memory = &vm.memory;
+  size_t live = 0;
+  for (unsigned i = 0; i < MEM_CATEGORY_COUNT; ++i)
+    live += memory->categories[i].live;
+  CHECK(live == memory->total.live);
+  CHECK(memory->total.allocated - memory->total.freed == memory->total.live);
+  CHECK(memory->total.peak >= memory->total.live);
+  CHECK(memory->categories[MEM_OBJ_STRING].allocated > 0);
+  size_t liveCode = memory->categories[MEM_CODE].live;
+  freeScript(&vm, readCount);
+  CHECK(memory->categories[MEM_CODE].live < liveCode);
+
+  // freeVM frees any scripts that are left.
+  freeVM(&vm);
+  fclose(errors);
+  free(output);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}